@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include "countfile.hpp"
+#include "header.hpp"
+#include "serial.hpp"
+#include "tippecanoe/projection.hpp"
+
+static unsigned long long sample(count_file const &cf, size_t k) {
+	if (cf.sums_map != NULL) {
+		return read64(cf.sums_map + SUMS_HEADER_BYTES + 8 * k);
+	}
+	return cf.sums[k];
+}
+
+// The modification time of a file, to the nanosecond if the system keeps it
+static void file_mtime(struct stat const &st, unsigned long long &sec, unsigned long long &nsec) {
+	sec = st.st_mtime;
+#ifdef __APPLE__
+	nsec = st.st_mtimespec.tv_nsec;
+#else
+	nsec = st.st_mtim.tv_nsec;
+#endif
+}
+
+// Maps the sidecar file if there is one, and if it was written for
+// a .count file of the same size and modification time as this one.
+// A whole-second time could miss a rewrite within the same second.
+static bool open_sums(count_file &cf) {
+	std::string fname = cf.name + SUMS_EXTENSION;
+
+	int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if ((size_t) st.st_size < SUMS_HEADER_BYTES) {
+		fprintf(stderr, "%s: ignoring out of date %s\n", cf.name.c_str(), fname.c_str());
+		close(fd);
+		return false;
+	}
+
+	unsigned char *map = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	size_t interval = read64(map + SUMS_MAGIC_LEN);
+	size_t records = read64(map + SUMS_MAGIC_LEN + 8);
+	unsigned long long count_size = read64(map + SUMS_MAGIC_LEN + 24);
+	unsigned long long mtime = read64(map + SUMS_MAGIC_LEN + 32);
+	unsigned long long mtime_nsec = read64(map + SUMS_MAGIC_LEN + 40);
+	if (memcmp(map, SUMS_MAGIC, SUMS_MAGIC_LEN) != 0 || interval == 0 || records != cf.nrecords ||
+	    count_size != cf.size || mtime != cf.mtime || mtime_nsec != cf.mtime_nsec ||
+	    (size_t) st.st_size != SUMS_HEADER_BYTES + 8 * ((records + interval - 1) / interval + 1)) {
+		fprintf(stderr, "%s: ignoring out of date %s\n", cf.name.c_str(), fname.c_str());
+		munmap(map, st.st_size);
+		close(fd);
+		return false;
+	}
+
+	cf.interval = interval;
+	cf.sums_fd = fd;
+	cf.sums_map = map;
+	cf.sums_size = st.st_size;
+	return true;
+}
+
+static void add_sums(count_file const &cf, size_t interval, std::vector<unsigned long long> &sums) {
+	unsigned long long total = 0;
+
+	sums.clear();
+	for (size_t i = 0; i < cf.nrecords; i++) {
+		if (i % interval == 0) {
+			sums.push_back(total);
+		}
+		total += count_record_count(cf, i);
+	}
+	sums.push_back(total);
+}
+
+void count_open(count_file &cf, const char *fname, bool sidecar) {
+	cf.name = fname;
+
+	cf.fd = open(fname, O_RDONLY);
+	if (cf.fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(cf.fd, &st) < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+	cf.size = st.st_size;
+	file_mtime(st, cf.mtime, cf.mtime_nsec);
+
+	if (cf.size < HEADER_LEN) {
+		fprintf(stderr, "%s: not a tile-count file\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	cf.map = (unsigned char *) mmap(NULL, cf.size, PROT_READ, MAP_SHARED, cf.fd, 0);
+	if (cf.map == MAP_FAILED) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (memcmp(cf.map, header_text, HEADER_LEN) != 0) {
+		fprintf(stderr, "%s: not a tile-count file\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	cf.records = cf.map + HEADER_LEN;
+	cf.nrecords = (cf.size - HEADER_LEN) / RECORD_BYTES;
+
+	if (!sidecar || !open_sums(cf)) {
+		cf.interval = COUNT_SUM_INTERVAL;
+		add_sums(cf, cf.interval, cf.sums);
+	}
+}
+
+void count_write_sums(count_file const &cf, size_t interval) {
+	std::vector<unsigned long long> sums;
+	add_sums(cf, interval, sums);
+
+	// Written under another name and then renamed, so that a reader
+	// never sees a partly written one
+	std::string fname = cf.name + SUMS_EXTENSION;
+	std::string tmp = fname + ".tmp";
+
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (fp == NULL) {
+		perror(tmp.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if (fwrite(SUMS_MAGIC, sizeof(char), SUMS_MAGIC_LEN, fp) != SUMS_MAGIC_LEN) {
+		perror(tmp.c_str());
+		exit(EXIT_FAILURE);
+	}
+	write64(fp, interval);
+	write64(fp, cf.nrecords);
+	write64(fp, sums.back());
+	write64(fp, cf.size);
+	write64(fp, cf.mtime);
+	write64(fp, cf.mtime_nsec);
+	for (size_t i = 0; i < sums.size(); i++) {
+		write64(fp, sums[i]);
+	}
+
+	if (fclose(fp) != 0) {
+		perror(tmp.c_str());
+		exit(EXIT_FAILURE);
+	}
+	if (rename(tmp.c_str(), fname.c_str()) != 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+void count_close(count_file &cf) {
+	if (cf.sums_map != NULL) {
+		if (munmap(cf.sums_map, cf.sums_size) != 0 || close(cf.sums_fd) != 0) {
+			perror((cf.name + SUMS_EXTENSION).c_str());
+			exit(EXIT_FAILURE);
+		}
+		cf.sums_map = NULL;
+		cf.sums_fd = -1;
+	}
+
+	if (munmap(cf.map, cf.size) != 0) {
+		perror(cf.name.c_str());
+		exit(EXIT_FAILURE);
+	}
+	if (close(cf.fd) != 0) {
+		perror(cf.name.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	cf.map = NULL;
+	cf.fd = -1;
+}
+
+unsigned long long count_record_key(count_file const &cf, size_t i) {
+	return read64((unsigned char *) cf.records + i * RECORD_BYTES);
+}
+
+unsigned long long count_record_count(count_file const &cf, size_t i) {
+	return read32((unsigned char *) cf.records + i * RECORD_BYTES + INDEX_BYTES);
+}
+
+size_t count_find(count_file const &cf, unsigned long long key) {
+	size_t lo = 0, hi = cf.nrecords;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (count_record_key(cf, mid) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+unsigned long long count_before(count_file const &cf, size_t i) {
+	size_t last = (cf.nrecords + cf.interval - 1) / cf.interval;
+	if (i >= cf.nrecords) {
+		return sample(cf, last);
+	}
+
+	// From whichever sample is nearer. The one after the last multiple
+	// of the interval is the total of all the records.
+	size_t below = i / cf.interval;
+	size_t above = below + 1;
+	size_t above_record = above * cf.interval;
+	if (above_record > cf.nrecords) {
+		above_record = cf.nrecords;
+	}
+
+	if (i - below * cf.interval <= above_record - i) {
+		unsigned long long total = sample(cf, below);
+		for (size_t j = below * cf.interval; j < i; j++) {
+			total += count_record_count(cf, j);
+		}
+		return total;
+	} else {
+		unsigned long long total = sample(cf, above);
+		for (size_t j = i; j < above_record; j++) {
+			total -= count_record_count(cf, j);
+		}
+		return total;
+	}
+}
+
+unsigned long long count_sum(count_file const &cf, unsigned long long first, unsigned long long last) {
+	size_t start = count_find(cf, first);
+	size_t end = cf.nrecords;
+	if (last != ULLONG_MAX) {
+		end = count_find(cf, last + 1);
+	}
+
+	if (end <= start) {
+		return 0;
+	}
+	return count_before(cf, end) - count_before(cf, start);
+}
+
+unsigned long long count_tile_sum(count_file const &cf, int z, unsigned long long x, unsigned long long y) {
+	unsigned long long first = encode(x << (32 - z), y << (32 - z));
+	unsigned long long last = ULLONG_MAX;
+	if (z > 0) {
+		last = first | ((1ULL << (2 * (32 - z))) - 1);
+	}
+
+	return count_sum(cf, first, last);
+}
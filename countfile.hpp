@@ -0,0 +1,78 @@
+#ifndef COUNTFILE_HPP
+#define COUNTFILE_HPP
+
+#include <string>
+#include <vector>
+
+// A .count file mapped into memory, with the running total of its counts
+// sampled every `interval` records, so that the total of any run of
+// records can be found from two samples and at most `interval` records
+// read on either side of them.
+//
+// The samples come from the sidecar file that tile-count-index writes
+// beside the .count file, if there is one that is up to date, or else
+// are added up when the file is opened. The sidecar is laid out as
+//
+//	SUMS_MAGIC
+//	the 64-bit interval, the 64-bit number of records, and the 64-bit
+//	    total of all the counts
+//	the 64-bit size of the .count file, and the seconds and nanoseconds
+//	    of its modification time, each 64 bits
+//	the total of the counts before each multiple of the interval,
+//	    and the total of all of them again, each 64 bits
+//
+// with all the numbers big-endian, as they are in .count files.
+
+#define COUNT_SUM_INTERVAL 64
+
+#define SUMS_MAGIC "tile-count index"
+#define SUMS_MAGIC_LEN 16
+#define SUMS_HEADER_BYTES (SUMS_MAGIC_LEN + 6 * 8)
+#define SUMS_EXTENSION ".sums"
+
+struct count_file {
+	std::string name;
+	int fd = -1;
+	unsigned char *map = NULL;
+	size_t size = 0;
+
+	const unsigned char *records = NULL;
+	size_t nrecords = 0;
+
+	// The modification time of the .count file, which the sidecar has to match
+	unsigned long long mtime = 0;
+	unsigned long long mtime_nsec = 0;
+
+	size_t interval = COUNT_SUM_INTERVAL;
+
+	// The samples, either added up in memory or mapped from the sidecar
+	std::vector<unsigned long long> sums;
+	int sums_fd = -1;
+	unsigned char *sums_map = NULL;
+	size_t sums_size = 0;
+};
+
+// With `sidecar`, the samples are read from the sidecar file if it is up to date
+void count_open(count_file &cf, const char *fname, bool sidecar = true);
+void count_close(count_file &cf);
+
+// Writes the sidecar file for an open count_file, sampled every `interval` records
+void count_write_sums(count_file const &cf, size_t interval);
+
+unsigned long long count_record_key(count_file const &cf, size_t i);
+unsigned long long count_record_count(count_file const &cf, size_t i);
+
+// The first record whose quadkey is at least `key`
+size_t count_find(count_file const &cf, unsigned long long key);
+
+// The total of the counts of the records before record `i`
+unsigned long long count_before(count_file const &cf, size_t i);
+
+// The total of the counts of the records whose quadkeys are
+// from `first` to `last`, inclusive
+unsigned long long count_sum(count_file const &cf, unsigned long long first, unsigned long long last);
+
+// The total of the counts within a tile
+unsigned long long count_tile_sum(count_file const &cf, int z, unsigned long long x, unsigned long long y);
+
+#endif
@@ -2,15 +2,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
-#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <vector>
+#include <atomic>
 #include "tippecanoe/projection.hpp"
 #include "header.hpp"
 #include "serial.hpp"
 #include "merge.hpp"
+#include "runtime.hpp"
 
 extern "C" {
 #include "jsonpull/jsonpull.h"
@@ -19,36 +22,80 @@ extern "C" {
 bool quiet = false;
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s -o out.count [-s binsize] [in.csv ...]\n", argv[0]);
+	fprintf(stderr, "Usage: %s -o out.count [-s binsize] [-p cpus] [-m megabytes] [in.csv ...]\n", argv[0]);
 }
 
-void write_point(FILE *out, long long &seq, double lon, double lat, unsigned long long count) {
-	if (seq % 100000 == 0) {
-		if (!quiet) {
-			fprintf(stderr, "Read %.1f million records\r", seq / 1000000.0);
+// Points are collected this many at a time so that they can be
+// projected together
+#define POINT_BATCH 4096
+
+// The smallest part of the file to sort at once under a memory budget
+#define MIN_SORT_UNIT (1024 * 1024)
+
+struct point_batch {
+	std::vector<double> lon;
+	std::vector<double> lat;
+	std::vector<unsigned long long> count;
+	std::vector<long long> x;
+	std::vector<long long> y;
+};
+
+void flush_points(FILE *out, point_batch &pb) {
+	size_t n = pb.lon.size();
+	pb.x.resize(n);
+	pb.y.resize(n);
+
+	if (projection == &projections[0]) {
+		lonlat2tile_batch(n, pb.lon.data(), pb.lat.data(), pb.x.data(), pb.y.data());
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			projection->project(pb.lon[i], pb.lat[i], 32, &pb.x[i], &pb.y[i]);
 		}
 	}
-	seq++;
 
-	long long x, y;
-	projection->project(lon, lat, 32, &x, &y);
+	for (size_t i = 0; i < n; i++) {
+		long long x = pb.x[i];
+		long long y = pb.y[i];
+		unsigned long long count = pb.count[i];
 
-	if (x >= 0 && y >= 0 && x < (1LL << 32) && y < (1LL << 32)) {
-		unsigned long long index = encode(x, y);
+		if (x >= 0 && y >= 0 && x < (1LL << 32) && y < (1LL << 32)) {
+			unsigned long long index = encode(x, y);
+
+			while (count > MAX_COUNT) {
+				write64(out, index);
+				write32(out, MAX_COUNT);
+
+				count -= MAX_COUNT;
+			}
 
-		while (count > MAX_COUNT) {
 			write64(out, index);
-			write32(out, MAX_COUNT);
+			write32(out, count);
+		}
+	}
+
+	pb.lon.clear();
+	pb.lat.clear();
+	pb.count.clear();
+}
 
-			count -= MAX_COUNT;
+void write_point(FILE *out, point_batch &pb, long long &seq, double lon, double lat, unsigned long long count) {
+	if (seq % 100000 == 0) {
+		if (!quiet) {
+			fprintf(stderr, "Read %.1f million records\r", seq / 1000000.0);
 		}
+	}
+	seq++;
 
-		write64(out, index);
-		write32(out, count);
+	pb.lon.push_back(lon);
+	pb.lat.push_back(lat);
+	pb.count.push_back(count);
+
+	if (pb.lon.size() >= POINT_BATCH) {
+		flush_points(out, pb);
 	}
 }
 
-void read_json(FILE *out, FILE *in, const char *fname, long long &seq) {
+void read_json(FILE *out, point_batch &pb, FILE *in, const char *fname, long long &seq) {
 	json_pull *jp = json_begin_file(in);
 
 	while (1) {
@@ -67,7 +114,7 @@ void read_json(FILE *out, FILE *in, const char *fname, long long &seq) {
 		} else if (j->type == JSON_ARRAY) {
 			if (j->length >= 2) {
 				if (j->array[0]->type == JSON_NUMBER && j->array[1]->type == JSON_NUMBER) {
-					write_point(out, seq, j->array[0]->number, j->array[1]->number, 1);
+					write_point(out, pb, seq, j->array[0]->number, j->array[1]->number, 1);
 				}
 			}
 			json_free(j);
@@ -77,13 +124,13 @@ void read_json(FILE *out, FILE *in, const char *fname, long long &seq) {
 	json_end(jp);
 }
 
-void read_into(FILE *out, FILE *in, const char *fname, long long &seq) {
+void read_into(FILE *out, point_batch &pb, FILE *in, const char *fname, long long &seq) {
 	int c = getc(in);
 	if (c != EOF) {
 		ungetc(c, in);
 	}
 	if (c == '{') {
-		read_json(out, in, fname, seq);
+		read_json(out, pb, in, fname, seq);
 		return;
 	}
 
@@ -112,7 +159,7 @@ void read_into(FILE *out, FILE *in, const char *fname, long long &seq) {
 			exit(EXIT_FAILURE);
 		}
 
-		write_point(out, seq, lon, lat, count);
+		write_point(out, pb, seq, lon, lat, count);
 	}
 }
 
@@ -120,8 +167,20 @@ int indexcmp(const void *p1, const void *p2) {
 	return memcmp(p1, p2, INDEX_BYTES);
 }
 
-void *run_sort(void *p) {
-	struct merge *m = (struct merge *) p;
+// The parts of the file, each sorted as one of the tasks of the thread pool
+struct sort_parts {
+	std::vector<struct merge> *merges;
+	std::atomic<size_t> started;
+};
+
+void run_sort(void *p, size_t part) {
+	sort_parts *s = (sort_parts *) p;
+	struct merge *m = &(*s->merges)[part];
+
+	size_t n = ++s->started;
+	if (!quiet) {
+		fprintf(stderr, "Sorting part %zu of %zu     \r", n, s->merges->size());
+	}
 
 	void *map = mmap(NULL, m->end - m->start, PROT_READ | PROT_WRITE, MAP_PRIVATE, m->fd, m->start);
 	if (map == MAP_FAILED) {
@@ -144,8 +203,6 @@ void *run_sort(void *p) {
 
 	munmap(map, m->end - m->start);
 	munmap(map2, m->end - m->start);
-
-	return NULL;
 }
 
 void sort_and_merge(int fd, int out, int zoom, size_t cpus) {
@@ -165,12 +222,29 @@ void sort_and_merge(int fd, int out, int zoom, size_t cpus) {
 
 	int page = sysconf(_SC_PAGESIZE);
 	long long unit = (50 * 1024 * 1024 / bytes) * bytes;
+
+	// Each sorting thread has a private copy of its part, the scratch space
+	// that qsort() merges it through, and then the sorted part that it
+	// writes back, so with a memory budget the parts are made small enough
+	// for all of them to fit at once, or if that would make them too small,
+	// fewer are sorted at once.
+	size_t sorters = cpus;
+	if (memory_budget > 0) {
+		sorters = budget_count(3 * MIN_SORT_UNIT, cpus);
+		long long fit = memory_budget / (3 * sorters);
+		if (fit < MIN_SORT_UNIT) {
+			fit = MIN_SORT_UNIT;
+		}
+		if (fit < unit) {
+			unit = (fit / bytes) * bytes;
+		}
+	}
 	while (unit % page != 0) {
 		unit += bytes;
 	}
 
 	size_t nmerges = (to_sort + unit - 1) / unit;
-	struct merge merges[nmerges];
+	std::vector<struct merge> merges(nmerges);
 
 	long long start;
 	for (start = 0; start < to_sort; start += unit) {
@@ -184,28 +258,10 @@ void sort_and_merge(int fd, int out, int zoom, size_t cpus) {
 		merges[start / unit].fd = fd;
 	}
 
-	for (size_t i = 0; i < nmerges; i += cpus) {
-		if (!quiet) {
-			fprintf(stderr, "Sorting part %zu of %zu     \r", i + 1, nmerges);
-		}
-
-		pthread_t pthreads[cpus];
-		for (size_t j = 0; j < cpus && i + j < nmerges; j++) {
-			if (pthread_create(&pthreads[j], NULL, run_sort, &merges[i + j]) != 0) {
-				perror("pthread_create (sort)");
-				exit(EXIT_FAILURE);
-			}
-		}
-
-		for (size_t j = 0; j < cpus && i + j < nmerges; j++) {
-			void *retval;
-
-			if (pthread_join(pthreads[j], &retval) != 0) {
-				perror("pthread_join (sort)");
-				exit(EXIT_FAILURE);
-			}
-		}
-	}
+	sort_parts parts;
+	parts.merges = &merges;
+	parts.started = 0;
+	run_tasks(sorters, nmerges, run_sort, &parts);
 
 	if (write(out, header_text, HEADER_LEN) != HEADER_LEN) {
 		perror("write header");
@@ -223,7 +279,7 @@ void sort_and_merge(int fd, int out, int zoom, size_t cpus) {
 			merges[i].map = (unsigned char *) map;
 		}
 
-		do_merge(merges, nmerges, out, bytes, to_sort / bytes, zoom, quiet, cpus, 0, 0);
+		do_merge(merges.data(), nmerges, out, bytes, to_sort / bytes, zoom, quiet, cpus, 0, 0);
 		munmap(map, st.st_size);
 	}
 }
@@ -234,10 +290,15 @@ int main(int argc, char **argv) {
 
 	char *outfile = NULL;
 	int zoom = 32;
-	size_t cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t cpus = available_cpus();
+
+	static struct option long_options[] = {
+		{"memory", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0},
+	};
 
 	int i;
-	while ((i = getopt(argc, argv, "fs:o:p:q")) != -1) {
+	while ((i = getopt_long(argc, argv, "fs:o:p:qm:", long_options, NULL)) != -1) {
 		switch (i) {
 		case 's':
 			zoom = atoi(optarg);
@@ -255,6 +316,10 @@ int main(int argc, char **argv) {
 			quiet = true;
 			break;
 
+		case 'm':
+			set_memory_budget(optarg, argv[0]);
+			break;
+
 		default:
 			usage(argv);
 			exit(EXIT_FAILURE);
@@ -292,8 +357,9 @@ int main(int argc, char **argv) {
 	}
 
 	long long seq = 0;
+	point_batch pb;
 	if (optind == argc) {
-		read_into(fp, stdin, "standard input", seq);
+		read_into(fp, pb, stdin, "standard input", seq);
 	} else {
 		for (; optind < argc; optind++) {
 			FILE *in = fopen(argv[optind], "r");
@@ -301,11 +367,12 @@ int main(int argc, char **argv) {
 				perror(argv[optind]);
 				exit(EXIT_FAILURE);
 			} else {
-				read_into(fp, in, argv[optind], seq);
+				read_into(fp, pb, in, argv[optind], seq);
 				fclose(in);
 			}
 		}
 	}
+	flush_points(fp, pb);
 	if (!quiet) {
 		fprintf(stderr, "Total of %lld\n", seq);
 	}
@@ -329,5 +396,8 @@ int main(int argc, char **argv) {
 		perror("close");
 	}
 
+	if (memory_budget > 0) {
+		report_memory(argv[0]);
+	}
 	return 0;
 }
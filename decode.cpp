@@ -2,22 +2,498 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
 #include "tippecanoe/projection.hpp"
 #include "header.hpp"
 #include "serial.hpp"
+#include "region.hpp"
+#include "runtime.hpp"
 #include "milo/dtoa_milo.h"
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s file.count ...\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-b | -c] [-i] [-s binsize] [--bbox minlon,minlat,maxlon,maxlat] [--tiles z/x/y] [-p cpus] [-m megabytes] file.count ...\n", argv[0]);
+}
+
+// Each thread formats this many records at a time into its own buffer,
+// and the buffers are written out in order once all the threads are done
+#define DECODE_CHUNK 65536
+
+// About how much memory a thread takes for each chunk, for the formatted
+// records and the columns they are formatted from
+#define DECODE_CHUNK_MEMORY (DECODE_CHUNK * 64)
+
+enum decode_format {
+	format_csv,
+	format_binary,
+	format_columns,
+};
+
+decode_format format = format_csv;
+bool tile_coordinates = false;  // zoom 32 x and y instead of lon and lat
+region decode_region;           // only the records within it, if it has any rectangles
+
+// With -s, the records within each tile at that zoom are summed into one
+// at the tile's corner, as tile-count-merge -s does. Locations keep the bits
+// of their quadkeys that `mask` covers.
+unsigned long long mask = ~0ULL;
+
+// With -b, each record is written as three little-endian numbers of the same size,
+// lon, lat, and count as two doubles and a 64-bit unsigned integer,
+// or with -i, x, y, and count as three 32-bit unsigned integers.
+//
+// With -c, the output is laid out as
+//
+//	COLUMNS_MAGIC
+//	for each block of up to DECODE_CHUNK records, the values of the
+//	    first column, then the second, then the third, each padded
+//	    with zeros to a multiple of 8 bytes
+//	the footer: the 64-bit number of columns, and for each column,
+//	    its 64-bit type, COLUMN_UINT32 or COLUMN_DOUBLE, and its name,
+//	    padded with NULs to COLUMN_NAME_LEN bytes; then the 64-bit
+//	    number of blocks, and for each block, its 64-bit offset from
+//	    the start of the file and its 64-bit number of records
+//	the 64-bit offset of the footer, and COLUMNS_MAGIC again
+//
+// with all the numbers little-endian, so that a reader can use each column
+// of each block in place as an array, once it has found the footer from the
+// last 24 bytes. The columns are lon, lat, and count, or x, y, and count.
+
+#define COLUMNS_MAGIC "tile-count table"
+#define COLUMNS_MAGIC_LEN 16
+#define COLUMN_NAME_LEN 16
+#define COLUMN_UINT32 1
+#define COLUMN_DOUBLE 2
+
+struct column_block {
+	unsigned long long offset;
+	unsigned long long records;
+};
+
+unsigned long long written = 0;
+std::vector<column_block> blocks;
+
+typedef std::vector<std::pair<size_t, size_t>> record_spans;
+
+struct decoder {
+	const unsigned char *records;
+	record_spans spans;
+	std::string out;
+
+	std::vector<unsigned> x;
+	std::vector<unsigned> y;
+	std::vector<unsigned> count;
+	std::vector<double> lon;
+	std::vector<double> lat;
+};
+
+static void append_le(std::string &out, unsigned long long v, size_t bytes) {
+	for (size_t i = 0; i < bytes; i++) {
+		out.push_back((v >> (8 * i)) & 0xFF);
+	}
+}
+
+static void append_double(std::string &out, double d) {
+	unsigned long long v;
+	memcpy(&v, &d, sizeof(v));
+	append_le(out, v, 8);
+}
+
+static void pad_column(std::string &out) {
+	while (out.size() % 8 != 0) {
+		out.push_back('\0');
+	}
+}
+
+static void append_count(std::string &out, unsigned long long count) {
+	char digits[20];
+	size_t n = 0;
+
+	do {
+		digits[n++] = '0' + count % 10;
+		count /= 10;
+	} while (count != 0);
+
+	while (n > 0) {
+		out.push_back(digits[--n]);
+	}
+}
+
+// Each chunk is formatted as one of the tasks of the thread pool
+void run_decode(void *v, size_t j) {
+	decoder *d = (decoder *) v + j;
+	bool filter = decode_region.rects.size() != 0;
+	std::vector<unsigned long long> keys;
+
+	d->x.clear();
+	d->y.clear();
+	d->count.clear();
+	for (size_t s = 0; s < d->spans.size(); s++) {
+		for (size_t i = d->spans[s].first; i < d->spans[s].second; i++) {
+			unsigned char *buf = (unsigned char *) d->records + i * RECORD_BYTES;
+			unsigned long long key = read64(buf);
+			unsigned count = read32(buf + INDEX_BYTES);
+
+			if (filter) {
+				unsigned x, y;
+				decode(key, &x, &y);
+				if (!region_intersects(decode_region, 32, x, y)) {
+					continue;
+				}
+			}
+
+			key &= mask;
+			if (keys.size() > 0 && keys.back() == key && d->count.back() + count <= MAX_COUNT) {
+				d->count.back() += count;
+			} else {
+				keys.push_back(key);
+				d->count.push_back(count);
+			}
+		}
+	}
+
+	size_t n = keys.size();
+	d->x.resize(n);
+	d->y.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		decode(keys[i], &d->x[i], &d->y[i]);
+	}
+
+	if (!tile_coordinates) {
+		d->lon.resize(n);
+		d->lat.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			projection->unproject(d->x[i], d->y[i], 32, &d->lon[i], &d->lat[i]);
+		}
+	}
+
+	d->out.clear();
+	if (format == format_csv) {
+		std::string lon_s, lat_s;
+
+		for (size_t i = 0; i < n; i++) {
+			if (tile_coordinates) {
+				append_count(d->out, d->x[i]);
+				d->out.push_back(',');
+				append_count(d->out, d->y[i]);
+			} else {
+				milo::dtoa_milo(d->lon[i], lon_s);
+				milo::dtoa_milo(d->lat[i], lat_s);
+
+				d->out.append(lon_s);
+				d->out.push_back(',');
+				d->out.append(lat_s);
+			}
+			d->out.push_back(',');
+			append_count(d->out, d->count[i]);
+			d->out.push_back('\n');
+		}
+	} else if (format == format_binary) {
+		for (size_t i = 0; i < n; i++) {
+			if (tile_coordinates) {
+				append_le(d->out, d->x[i], 4);
+				append_le(d->out, d->y[i], 4);
+				append_le(d->out, d->count[i], 4);
+			} else {
+				append_double(d->out, d->lon[i]);
+				append_double(d->out, d->lat[i]);
+				append_le(d->out, d->count[i], 8);
+			}
+		}
+	} else {
+		if (tile_coordinates) {
+			for (size_t i = 0; i < n; i++) {
+				append_le(d->out, d->x[i], 4);
+			}
+			pad_column(d->out);
+			for (size_t i = 0; i < n; i++) {
+				append_le(d->out, d->y[i], 4);
+			}
+			pad_column(d->out);
+		} else {
+			for (size_t i = 0; i < n; i++) {
+				append_double(d->out, d->lon[i]);
+			}
+			for (size_t i = 0; i < n; i++) {
+				append_double(d->out, d->lat[i]);
+			}
+		}
+		for (size_t i = 0; i < n; i++) {
+			append_le(d->out, d->count[i], 4);
+		}
+		pad_column(d->out);
+	}
+}
+
+static void write_out(std::string const &s) {
+	if (fwrite(s.c_str(), sizeof(char), s.size(), stdout) != s.size()) {
+		perror("standard output");
+		exit(EXIT_FAILURE);
+	}
+	written += s.size();
+}
+
+static void write_column(std::string &out, int type, const char *name) {
+	char padded[COLUMN_NAME_LEN] = {0};
+	memcpy(padded, name, strlen(name));
+
+	append_le(out, type, 8);
+	out.append(padded, COLUMN_NAME_LEN);
+}
+
+static void write_footer() {
+	std::string out;
+	unsigned long long footer = written;
+
+	append_le(out, 3, 8);
+	if (tile_coordinates) {
+		write_column(out, COLUMN_UINT32, "x");
+		write_column(out, COLUMN_UINT32, "y");
+	} else {
+		write_column(out, COLUMN_DOUBLE, "lon");
+		write_column(out, COLUMN_DOUBLE, "lat");
+	}
+	write_column(out, COLUMN_UINT32, "count");
+
+	append_le(out, blocks.size(), 8);
+	for (size_t i = 0; i < blocks.size(); i++) {
+		append_le(out, blocks[i].offset, 8);
+		append_le(out, blocks[i].records, 8);
+	}
+
+	append_le(out, footer, 8);
+	out.append(COLUMNS_MAGIC, COLUMNS_MAGIC_LEN);
+	write_out(out);
+}
+
+static unsigned long long record_key(const unsigned char *records, size_t i) {
+	return read64((unsigned char *) records + i * RECORD_BYTES);
+}
+
+// The first record from `lo` up to `hi` whose quadkey is at least `key`
+static size_t find_record_key(const unsigned char *records, size_t lo, size_t hi, unsigned long long key) {
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (record_key(records, mid) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Divides the spans into chunks of about DECODE_CHUNK records for the
+// threads, never separating records that -s will sum together
+static std::vector<record_spans> split_spans(const unsigned char *records, record_spans const &spans) {
+	std::vector<record_spans> chunks;
+	size_t in_chunk = DECODE_CHUNK;
+	size_t last = 0;
+
+	for (size_t i = 0; i < spans.size(); i++) {
+		size_t pos = spans[i].first;
+		size_t end = spans[i].second;
+
+		while (pos < end) {
+			if (in_chunk >= DECODE_CHUNK) {
+				if (chunks.size() > 0 && mask != ~0ULL) {
+					// The rest of the last record's tile goes in the same chunk
+					unsigned long long tile_end = record_key(records, last) | ~mask;
+					size_t stop = end;
+					if (tile_end != ULLONG_MAX) {
+						stop = find_record_key(records, pos, end, tile_end + 1);
+					}
+					if (stop > pos) {
+						chunks.back().push_back(std::pair<size_t, size_t>(pos, stop));
+						last = stop - 1;
+						pos = stop;
+						continue;
+					}
+				}
+
+				chunks.push_back(record_spans());
+				in_chunk = 0;
+			}
+
+			size_t take = end - pos;
+			if (take > DECODE_CHUNK - in_chunk) {
+				take = DECODE_CHUNK - in_chunk;
+			}
+
+			chunks.back().push_back(std::pair<size_t, size_t>(pos, pos + take));
+			in_chunk += take;
+			pos += take;
+			last = pos - 1;
+		}
+	}
+
+	return chunks;
+}
+
+void decode_file(const char *fname, size_t cpus) {
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("stat");
+		exit(EXIT_FAILURE);
+	}
+
+	if (st.st_size < HEADER_LEN) {
+		fprintf(stderr, "%s: not a tile-count file\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned char *map = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	if (memcmp(map, header_text, HEADER_LEN) != 0) {
+		fprintf(stderr, "%s: not a tile-count file\n", fname);
+		exit(EXIT_FAILURE);
+	}
+
+	const unsigned char *records = map + HEADER_LEN;
+	size_t nrecords = (st.st_size - HEADER_LEN) / RECORD_BYTES;
+
+	// Only the runs of records whose quadkeys are in the region's ranges are read
+	record_spans spans;
+	if (decode_region.rects.size() == 0) {
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		spans.push_back(std::pair<size_t, size_t>(0, nrecords));
+	} else {
+		std::vector<std::pair<unsigned long long, unsigned long long>> ranges = region_key_ranges(decode_region, region_range_zoom(decode_region));
+		size_t lo = 0;
+
+		for (size_t i = 0; i < ranges.size(); i++) {
+			size_t start = find_record_key(records, lo, nrecords, ranges[i].first);
+			size_t end = nrecords;
+			if (ranges[i].second != ULLONG_MAX) {
+				end = find_record_key(records, start, nrecords, ranges[i].second + 1);
+			}
+			if (start < end) {
+				spans.push_back(std::pair<size_t, size_t>(start, end));
+			}
+			lo = end;
+		}
+	}
+
+	std::vector<record_spans> chunks = split_spans(records, spans);
+
+	// With a memory budget, fewer chunks are formatted at once, and
+	// the pages of the file are released once they have been formatted
+	size_t batch = budget_count(DECODE_CHUNK_MEMORY, cpus);
+	std::vector<decoder> decoders(std::min(batch, chunks.size()));
+	unsigned char *released = map;
+
+	for (size_t start = 0; start < chunks.size(); start += batch) {
+		size_t running = 0;
+
+		for (size_t j = 0; j < batch && start + j < chunks.size(); j++) {
+			decoders[j].records = records;
+			decoders[j].spans = chunks[start + j];
+			running++;
+		}
+
+		run_tasks(cpus, running, run_decode, decoders.data());
+
+		for (size_t j = 0; j < running; j++) {
+			if (format == format_columns) {
+				column_block b;
+				b.offset = written;
+				b.records = decoders[j].count.size();
+				blocks.push_back(b);
+			}
+			write_out(decoders[j].out);
+		}
+
+		if (memory_budget > 0 && chunks[start + running - 1].size() > 0) {
+			record_spans const &last = chunks[start + running - 1];
+			released = release_pages(released, map + HEADER_LEN + last.back().second * RECORD_BYTES, false);
+		}
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
 }
 
 int main(int argc, char **argv) {
 	extern int optind;
+	extern char *optarg;
+
+	size_t cpus = available_cpus();
+	int zoom = 32;
+
+	enum {
+		OPT_BBOX = 256,
+		OPT_TILES,
+	};
+
+	static struct option long_options[] = {
+		{"bbox", required_argument, NULL, OPT_BBOX},
+		{"tiles", required_argument, NULL, OPT_TILES},
+		{"memory", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0},
+	};
 
 	int i;
-	while ((i = getopt(argc, argv, "")) != -1) {
+	while ((i = getopt_long(argc, argv, "bcis:p:m:", long_options, NULL)) != -1) {
 		switch (i) {
+		case OPT_BBOX:
+			if (!region_add_bbox(decode_region, optarg)) {
+				fprintf(stderr, "%s: --bbox %s is not minlon,minlat,maxlon,maxlat\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_TILES:
+			if (!region_add_tiles(decode_region, optarg)) {
+				fprintf(stderr, "%s: --tiles %s is not a list of z/x/y tiles\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 's':
+			zoom = atoi(optarg);
+			break;
+
+		case 'b':
+			format = format_binary;
+			break;
+
+		case 'c':
+			format = format_columns;
+			break;
+
+		case 'i':
+			tile_coordinates = true;
+			break;
+
+		case 'p':
+			if (atoi(optarg) < 1) {
+				fprintf(stderr, "%s: cpu count %s must be positive\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			cpus = atoi(optarg);
+			break;
+
+		case 'm':
+			set_memory_budget(optarg, argv[0]);
+			break;
+
 		default:
 			usage(argv);
 			exit(EXIT_FAILURE);
@@ -29,37 +505,34 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	for (; optind < argc; optind++) {
-		FILE *f = fopen(argv[optind], "rb");
-		if (f == NULL) {
-			perror(optind[argv]);
-			exit(EXIT_FAILURE);
-		}
-
-		char header[HEADER_LEN];
-		if (fread(header, HEADER_LEN, 1, f) != 1) {
-			perror("read header");
-			exit(EXIT_FAILURE);
-		}
+	if (zoom < 0 || zoom > 32) {
+		fprintf(stderr, "%s: zoom (-s) must be in the range 0 to 32, not %d\n", argv[0], zoom);
+		exit(EXIT_FAILURE);
+	}
+	if (zoom == 0) {
+		mask = 0;
+	} else {
+		mask = ~0ULL << (64 - 2 * zoom);
+	}
 
-		if (memcmp(header, header_text, HEADER_LEN) != 0) {
-			fprintf(stderr, "%s: not a tile-count file\n", argv[optind]);
-			exit(EXIT_FAILURE);
-		}
+	if (format == format_columns) {
+		write_out(std::string(COLUMNS_MAGIC, COLUMNS_MAGIC_LEN));
+	}
 
-		unsigned char buf[RECORD_BYTES];
-		while (fread(buf, RECORD_BYTES, 1, f) == 1) {
-			unsigned long long index = read64(buf);
-			unsigned long long count = read32(buf + INDEX_BYTES);
+	for (; optind < argc; optind++) {
+		decode_file(argv[optind], cpus);
+	}
 
-			unsigned x, y;
-			decode(index, &x, &y);
+	if (format == format_columns) {
+		write_footer();
+	}
 
-			double lon, lat;
-			projection->unproject(x, y, 32, &lon, &lat);
-			printf("%s,%s,%llu\n", milo::dtoa_milo(lon).c_str(), milo::dtoa_milo(lat).c_str(), count);
-		}
+	if (fflush(stdout) != 0) {
+		perror("standard output");
+		exit(EXIT_FAILURE);
+	}
 
-		fclose(f);
+	if (memory_budget > 0) {
+		report_memory(argv[0]);
 	}
 }
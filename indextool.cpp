@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "countfile.hpp"
+
+void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-n interval] file.count ...\n", argv[0]);
+}
+
+int main(int argc, char **argv) {
+	extern int optind;
+	extern char *optarg;
+
+	long long interval = COUNT_SUM_INTERVAL;
+
+	int i;
+	while ((i = getopt(argc, argv, "n:")) != -1) {
+		switch (i) {
+		case 'n':
+			interval = atoll(optarg);
+			break;
+
+		default:
+			usage(argv);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (interval < 1) {
+		fprintf(stderr, "%s: interval (-n) must be at least 1, not %lld\n", argv[0], interval);
+		exit(EXIT_FAILURE);
+	}
+
+	for (; optind < argc; optind++) {
+		count_file cf;
+		count_open(cf, argv[optind], false);
+		count_write_sums(cf, interval);
+		count_close(cf);
+	}
+
+	return 0;
+}
@@ -6,16 +6,20 @@
 #include <iterator>
 #include <algorithm>
 #include <atomic>
-#include <pthread.h>
 #include <sys/mman.h>
 #include "merge.hpp"
 #include "header.hpp"
 #include "serial.hpp"
 #include "algorithm_mod.hpp"
+#include "runtime.hpp"
+
+// The smallest stretch of a mapped file to release at once under a memory budget
+#define MIN_RELEASE (64 * 1024)
 
 struct merger {
 	unsigned char *start;
 	unsigned char *end;
+	unsigned char *released;  // where the pages not yet released begin
 
 	bool operator<(const merger &m) const {
 		// > 0 so that lowest quadkey comes first
@@ -34,8 +38,22 @@ unsigned char *do_merge1(std::vector<merger> &merges, size_t nmerges, unsigned c
 	long long along = 0;
 	long long reported = -1;
 
+	// With a memory budget, the pages of the inputs that have been merged
+	// and of the output that has been written are released as the merge
+	// goes along, so that only a share of the budget for each of them
+	// is resident at once.
+	size_t release = 0;
+	if (memory_budget > 0) {
+		release = memory_budget / (2 * nshards * (nmerges + 1));
+		if (release < MIN_RELEASE) {
+			release = MIN_RELEASE;
+		}
+	}
+	unsigned char *out_released = f;
+
 	for (size_t i = 0; i < nmerges; i++) {
 		if (merges[i].start < merges[i].end) {
+			merges[i].released = merges[i].start;
 			q.push(merges[i]);
 		}
 	}
@@ -59,6 +77,10 @@ unsigned char *do_merge1(std::vector<merger> &merges, size_t nmerges, unsigned c
 			if (current_count != 0) {
 				write64(&f, current_index);
 				write32(&f, current_count);
+
+				if (release > 0 && (size_t) (f - out_released) >= release) {
+					out_released = release_pages(out_released, f, true);
+				}
 			}
 
 			current_index = new_index;
@@ -67,6 +89,9 @@ unsigned char *do_merge1(std::vector<merger> &merges, size_t nmerges, unsigned c
 		current_count += count;
 
 		head.start += bytes;
+		if (release > 0 && (size_t) (head.start - head.released) >= release) {
+			head.released = release_pages(head.released, head.start, false);
+		}
 		if (head.start < head.end) {
 			q.push(head);
 		}
@@ -120,8 +145,9 @@ struct finder {
 	}
 };
 
-void *run_merge(void *va) {
-	merge_arg *a = (merge_arg *) va;
+// Each shard of the output is merged as one of the tasks of the thread pool
+void run_merge(void *va, size_t shard) {
+	merge_arg *a = (merge_arg *) va + shard;
 
 	size_t nrec = 0;
 	for (size_t i = 0; i < a->mergers.size(); i++) {
@@ -130,8 +156,6 @@ void *run_merge(void *va) {
 
 	unsigned char *end = do_merge1(a->mergers, a->mergers.size(), a->out + a->off, RECORD_BYTES, nrec, a->zoom, a->quiet, a->progress, a->shard, a->nshards, a->also_todo, a->also_did);
 	a->outlen = end - (a->out + a->off);
-
-	return NULL;
 }
 
 void do_merge(struct merge *merges, size_t nmerges, int f, int bytes, long long nrec, int zoom, bool quiet, size_t cpus, size_t also_todo, size_t also_did) {
@@ -274,27 +298,17 @@ void do_merge(struct merge *merges, size_t nmerges, int f, int bytes, long long
 
 	memcpy(map, header_text, HEADER_LEN);
 
-	pthread_t threads[cpus];
 	for (size_t i = 0; i < cpus; i++) {
 		args[i].out = (unsigned char *) map;
 		args[i].zoom = zoom;
-
-		if (pthread_create(&threads[i], NULL, run_merge, &args[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
-		}
 	}
 
+	run_tasks(cpus, cpus, run_merge, args.data());
+
 	size_t outpos = HEADER_LEN;
 	size_t inpos = HEADER_LEN;
 
 	for (size_t i = 0; i < cpus; i++) {
-		void *ret;
-		if (pthread_join(threads[i], &ret) != 0) {
-			perror("pthread_join");
-			exit(EXIT_FAILURE);
-		}
-
 		if (inpos != outpos) {
 			memmove((unsigned char *) map + outpos, (unsigned char *) map + inpos, args[i].outlen);
 		}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -10,13 +11,14 @@
 #include "header.hpp"
 #include "serial.hpp"
 #include "merge.hpp"
+#include "runtime.hpp"
 
 void submerge(std::vector<std::string> fnames, int out, const char *argv0, int zoom, int cpus, size_t *also_todo, size_t *also_did);
 
 bool quiet = false;
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s -o merged.count file.count ...\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-p cpus] [-m megabytes] -o merged.count file.count ...\n", argv[0]);
 }
 
 void trim(char *s) {
@@ -42,11 +44,16 @@ int main(int argc, char **argv) {
 
 	char *outfile = NULL;
 	int zoom = 32;
-	size_t cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t cpus = available_cpus();
 	bool readfiles = false;
 
+	static struct option long_options[] = {
+		{"memory", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0},
+	};
+
 	int i;
-	while ((i = getopt(argc, argv, "o:s:qp:F")) != -1) {
+	while ((i = getopt_long(argc, argv, "o:s:qp:Fm:", long_options, NULL)) != -1) {
 		switch (i) {
 		case 's':
 			zoom = atoi(optarg);
@@ -68,6 +75,10 @@ int main(int argc, char **argv) {
 			readfiles = true;
 			break;
 
+		case 'm':
+			set_memory_budget(optarg, argv[0]);
+			break;
+
 		default:
 			usage(argv);
 			exit(EXIT_FAILURE);
@@ -102,6 +113,9 @@ int main(int argc, char **argv) {
 	size_t also_todo = 0, also_did = 0;
 	submerge(fnames, out, argv[0], zoom, cpus, &also_todo, &also_did);
 
+	if (memory_budget > 0) {
+		report_memory(argv[0]);
+	}
 	return 0;
 }
 
@@ -378,18 +378,22 @@ inline void Prettify(std::string &buffer, int length, int k) {
 	}
 }
 
-inline std::string dtoa_milo(double value) {
-	std::string buffer;
+// Into a buffer supplied by the caller, which is cleared first,
+// so that it can be reused without allocating again
+inline void dtoa_milo(double value, std::string &buffer) {
+	buffer.clear();
 
 	if (std::isnan(value)) {
-		return "nan";
+		buffer = "nan";
+		return;
 	}
 	if (std::isinf(value)) {
 		if (value < 0) {
-			return "-inf";
+			buffer = "-inf";
 		} else {
-			return "inf";
+			buffer = "inf";
 		}
+		return;
 	}
 
 	if (value == 0) {
@@ -408,7 +412,11 @@ inline std::string dtoa_milo(double value) {
 			buffer.insert(buffer.begin(), '-');
 		}
 	}
+}
 
+inline std::string dtoa_milo(double value) {
+	std::string buffer;
+	dtoa_milo(value, buffer);
 	return buffer;
 }
 
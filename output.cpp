@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "output.hpp"
+#include "serial.hpp"
+#include "tippecanoe/mbtiles.hpp"
+
+static void make_dir(std::string const &dir) {
+	if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+		perror(dir.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+static bool all_digits(const char *s, const char *end) {
+	if (s == end) {
+		return false;
+	}
+	for (; s < end; s++) {
+		if (*s < '0' || *s > '9') {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Whether a name within a tile directory is one that tile-count-tile
+// writes: metadata.json at the top, z and x directories, and y files
+static bool tile_dir_name(const char *name, int depth, bool isdir) {
+	if (depth == 0 && !isdir && strcmp(name, "metadata.json") == 0) {
+		return true;
+	}
+	if (depth < 2) {
+		return isdir && all_digits(name, name + strlen(name));
+	}
+
+	const char *dot = strrchr(name, '.');
+	return !isdir && dot != NULL && all_digits(name, dot) && (strcmp(dot, ".pbf") == 0 || strcmp(dot, ".png") == 0);
+}
+
+// Checks that a directory holds only tiles and metadata, or with `remove`,
+// removes them. Returns the first thing in it that is not a tile, if any.
+static std::string clear_tile_dir(std::string const &dir, int depth, bool remove) {
+	DIR *d = opendir(dir.c_str());
+	if (d == NULL) {
+		perror(dir.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::string stray;
+	struct dirent *de;
+	while (stray.empty() && (de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+
+		std::string path = dir + "/" + de->d_name;
+		struct stat st;
+		if (lstat(path.c_str(), &st) != 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		bool isdir = S_ISDIR(st.st_mode);
+		if (!tile_dir_name(de->d_name, depth, isdir)) {
+			stray = path;
+		} else if (isdir) {
+			stray = clear_tile_dir(path, depth + 1, remove);
+			if (remove && rmdir(path.c_str()) != 0) {
+				perror(path.c_str());
+				exit(EXIT_FAILURE);
+			}
+		} else if (remove && unlink(path.c_str()) != 0) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	closedir(d);
+	return stray;
+}
+
+static void write_fully(tile_output &out, const char *data, size_t len) {
+	if (fwrite(data, sizeof(char), len, out.fp) != len) {
+		perror(out.name.c_str());
+		exit(EXIT_FAILURE);
+	}
+	out.offset += len;
+}
+
+void output_open(tile_output &out, output_kind kind, char *name, char **argv, bool force, bool deduplicate, bool bitmap, bool update) {
+	out.kind = kind;
+	out.name = name;
+	out.extension = bitmap ? "png" : "pbf";
+
+	if (kind == output_mbtiles) {
+		struct stat st;
+		if (force) {
+			unlink(name);
+		} else if (update && stat(name, &st) == 0) {
+			out.db = mbtiles_reopen(name, argv);
+			out.update = true;
+			return;
+		}
+		out.db = mbtiles_open(name, argv, false, deduplicate);
+		return;
+	}
+
+	if (deduplicate) {
+		fprintf(stderr, "%s: -D only applies to mbtiles output\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (kind == output_directory) {
+		struct stat st;
+		if (stat(name, &st) == 0) {
+			if (!force) {
+				fprintf(stderr, "%s: %s already exists\n", argv[0], name);
+				exit(EXIT_FAILURE);
+			}
+
+			// Tiles from an earlier run would be left beside the new ones,
+			// so they are removed, but only if there is nothing else there
+			if (!S_ISDIR(st.st_mode)) {
+				fprintf(stderr, "%s: %s is not a directory\n", argv[0], name);
+				exit(EXIT_FAILURE);
+			}
+			std::string stray = clear_tile_dir(out.name, 0, false);
+			if (!stray.empty()) {
+				fprintf(stderr, "%s: not replacing %s, because %s is not a tile\n", argv[0], name, stray.c_str());
+				exit(EXIT_FAILURE);
+			}
+			clear_tile_dir(out.name, 0, true);
+		}
+		make_dir(out.name);
+	} else {
+		if (force) {
+			unlink(name);
+		}
+
+		int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd < 0) {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+		out.fp = fdopen(fd, "wb");
+		if (out.fp == NULL) {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+
+		write_fully(out, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN);
+	}
+
+	// The metadata is collected the same way as for mbtiles, but in a
+	// temporary database, and written out beside the tiles at the end
+	if (sqlite3_open("", &out.db) != SQLITE_OK) {
+		fprintf(stderr, "%s: temporary database: %s\n", argv[0], sqlite3_errmsg(out.db));
+		exit(EXIT_FAILURE);
+	}
+	char *err = NULL;
+	if (sqlite3_exec(out.db, "CREATE TABLE metadata (name text, value text);", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: create metadata table: %s\n", argv[0], err);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void output_start(tile_output &out, size_t batch) {
+	if (out.kind == output_mbtiles) {
+		out.mbtiles.replace = out.update;
+		mbtiles_writer_open(out.mbtiles, out.db, batch);
+	}
+}
+
+void output_tile(tile_output &out, int z, long long x, long long y, const char *data, size_t len) {
+	if (out.kind == output_mbtiles) {
+		mbtiles_writer_tile(out.mbtiles, z, x, y, data, len);
+	} else if (out.kind == output_directory) {
+		std::string dir = out.name + "/" + std::to_string(z) + "/" + std::to_string(x);
+
+		// Tiles mostly arrive in order, so most of them go
+		// into the same directory as the one before
+		if (dir != out.last_dir) {
+			make_dir(out.name + "/" + std::to_string(z));
+			make_dir(dir);
+			out.last_dir = dir;
+		}
+
+		std::string fname = dir + "/" + std::to_string(y) + "." + out.extension;
+		FILE *fp = fopen(fname.c_str(), "wb");
+		if (fp == NULL) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fwrite(data, sizeof(char), len, fp) != len) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fclose(fp) != 0) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		archive_entry ae;
+		ae.z = z;
+		ae.x = x;
+		ae.y = y;
+		ae.offset = out.offset;
+		ae.length = len;
+		out.index.push_back(ae);
+
+		write_fully(out, data, len);
+	}
+}
+
+void output_finish(tile_output &out) {
+	if (out.kind == output_mbtiles) {
+		mbtiles_writer_close(out.mbtiles);
+	}
+}
+
+void output_close(tile_output &out, const char *pgm) {
+	if (out.kind == output_mbtiles) {
+		if (out.update && mbtiles_has_map(out.db)) {
+			// Drop the images that no tile refers to any more
+			char *err = NULL;
+			if (sqlite3_exec(out.db, "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);", NULL, NULL, &err) != SQLITE_OK) {
+				fprintf(stderr, "%s: delete unused images: %s\n", pgm, err);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		mbtiles_close(out.db, pgm);
+		return;
+	}
+
+	std::string json = mbtiles_metadata_json(out.db);
+	if (sqlite3_close(out.db) != SQLITE_OK) {
+		fprintf(stderr, "%s: could not close temporary database: %s\n", pgm, sqlite3_errmsg(out.db));
+		exit(EXIT_FAILURE);
+	}
+
+	if (out.kind == output_directory) {
+		std::string fname = out.name + "/metadata.json";
+		FILE *fp = fopen(fname.c_str(), "w");
+		if (fp == NULL) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fwrite(json.c_str(), sizeof(char), json.size(), fp) != json.size()) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fclose(fp) != 0) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
+	std::sort(out.index.begin(), out.index.end());
+
+	unsigned long long index_offset = out.offset;
+	for (size_t i = 0; i < out.index.size(); i++) {
+		write32(out.fp, out.index[i].z);
+		write32(out.fp, out.index[i].x);
+		write32(out.fp, out.index[i].y);
+		write64(out.fp, out.index[i].offset);
+		write32(out.fp, out.index[i].length);
+	}
+	out.offset += out.index.size() * ARCHIVE_INDEX_BYTES;
+
+	unsigned long long metadata_offset = out.offset;
+	write_fully(out, json.c_str(), json.size());
+
+	write64(out.fp, index_offset);
+	write64(out.fp, out.index.size());
+	write64(out.fp, metadata_offset);
+	write64(out.fp, json.size());
+	write_fully(out, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN);
+
+	if (fclose(out.fp) != 0) {
+		perror(out.name.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
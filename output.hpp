@@ -0,0 +1,85 @@
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <stdio.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include "tippecanoe/mbtiles.hpp"
+
+// Where tile-count-tile puts its tiles: an mbtiles database, a tree of
+// z/x/y files with a metadata.json beside them, or a single archive file.
+// The directory and the archive are only ever added to, never updated.
+
+enum output_kind {
+	output_mbtiles,
+	output_directory,
+	output_archive,
+};
+
+// An archive is laid out as
+//
+//	ARCHIVE_MAGIC
+//	the data of each tile, one after another, in the order they were written
+//	the index: for each tile, in z/x/y order, 32-bit z, x, and y,
+//	    a 64-bit offset from the start of the file, and a 32-bit length
+//	the metadata, as the same JSON object as in a directory's metadata.json
+//	the 64-bit offset and count of the index entries,
+//	    the 64-bit offset and length of the metadata, and ARCHIVE_MAGIC again
+//
+// with all the numbers big-endian, as they are in .count files,
+// so a reader can find everything from the last 48 bytes.
+
+#define ARCHIVE_MAGIC "tile-count tiles"
+#define ARCHIVE_MAGIC_LEN 16
+#define ARCHIVE_INDEX_BYTES (3 * 4 + 8 + 4)
+#define ARCHIVE_TRAILER_BYTES (4 * 8 + ARCHIVE_MAGIC_LEN)
+
+struct archive_entry {
+	unsigned z;
+	unsigned x;
+	unsigned y;
+	unsigned long long offset;
+	unsigned long long length;
+
+	bool operator<(archive_entry const &o) const {
+		if (z != o.z) {
+			return z < o.z;
+		}
+		if (x != o.x) {
+			return x < o.x;
+		}
+		return y < o.y;
+	}
+};
+
+struct tile_output {
+	output_kind kind = output_mbtiles;
+	std::string name;
+	std::string extension;
+
+	// The mbtiles database, or for the other kinds,
+	// a temporary one that only holds the metadata
+	sqlite3 *db = NULL;
+	mbtiles_writer mbtiles;
+	bool update = false;  // replacing some of the tiles of an existing mbtiles
+
+	FILE *fp = NULL;
+	unsigned long long offset = 0;
+	std::vector<archive_entry> index;
+	std::string last_dir;
+};
+
+// With `update`, an mbtiles that already exists (and -f was not given)
+// is opened to have some of its tiles replaced instead of being an error
+void output_open(tile_output &out, output_kind kind, char *name, char **argv, bool force, bool deduplicate, bool bitmap, bool update);
+
+// Called from the writer thread around the tiles it writes
+void output_start(tile_output &out, size_t batch);
+void output_tile(tile_output &out, int z, long long x, long long y, const char *data, size_t len);
+void output_finish(tile_output &out);
+
+// Writes out the metadata that has been put into out.db and closes the output
+void output_close(tile_output &out, const char *pgm);
+
+#endif
@@ -0,0 +1,348 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <utility>
+#include <vector>
+
+static inline double pipeline_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A bounded multi-producer, multi-consumer queue connecting the
+// stages of the tiling pipeline. Producers block while it is full
+// and consumers block while it is empty, so memory use stays fixed
+// no matter which stage is the bottleneck.
+
+template <typename T>
+struct bounded_queue {
+	std::deque<T> items;
+	size_t limit;
+	bool closed = false;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+
+	// Statistics, protected by the lock
+	size_t pushes = 0;
+	size_t max_depth = 0;
+	double depth_sum = 0;
+	double push_wait = 0;
+	double pop_wait = 0;
+
+	bounded_queue(size_t n) {
+		limit = n;
+		if (limit < 1) {
+			limit = 1;
+		}
+
+		if (pthread_mutex_init(&lock, NULL) != 0 ||
+		    pthread_cond_init(&not_empty, NULL) != 0 ||
+		    pthread_cond_init(&not_full, NULL) != 0) {
+			perror("pthread queue init");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	~bounded_queue() {
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&not_empty);
+		pthread_cond_destroy(&not_full);
+	}
+
+	void push(T &&item) {
+		acquire();
+
+		if (items.size() >= limit) {
+			double before = pipeline_now();
+			while (items.size() >= limit) {
+				pthread_cond_wait(&not_full, &lock);
+			}
+			push_wait += pipeline_now() - before;
+		}
+
+		items.push_back(std::move(item));
+
+		pushes++;
+		depth_sum += items.size();
+		if (items.size() > max_depth) {
+			max_depth = items.size();
+		}
+
+		pthread_cond_signal(&not_empty);
+		release();
+	}
+
+	// Wait for at least one item and then take up to max of them.
+	// Returns false once the queue has been closed and drained.
+	bool pop(std::vector<T> &out, size_t max) {
+		out.clear();
+		acquire();
+
+		if (items.size() == 0 && !closed) {
+			double before = pipeline_now();
+			while (items.size() == 0 && !closed) {
+				pthread_cond_wait(&not_empty, &lock);
+			}
+			pop_wait += pipeline_now() - before;
+		}
+
+		while (items.size() > 0 && out.size() < max) {
+			out.push_back(std::move(items.front()));
+			items.pop_front();
+		}
+
+		pthread_cond_broadcast(&not_full);
+		release();
+
+		return out.size() > 0;
+	}
+
+	void close() {
+		acquire();
+		closed = true;
+		pthread_cond_broadcast(&not_empty);
+		release();
+	}
+
+	double average_depth() {
+		if (pushes == 0) {
+			return 0;
+		}
+		return depth_sum / pushes;
+	}
+
+	void acquire() {
+		if (pthread_mutex_lock(&lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	void release() {
+		if (pthread_mutex_unlock(&lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+	}
+};
+
+// Waiting for a lock-free queue: yield a few times,
+// then sleep for progressively longer, up to a millisecond.
+static inline void pipeline_backoff(size_t &tries) {
+	if (tries < 16) {
+		sched_yield();
+	} else {
+		struct timespec ts;
+		ts.tv_sec = 0;
+		ts.tv_nsec = 10000L << (tries < 23 ? tries - 16 : 7);
+		nanosleep(&ts, NULL);
+	}
+	tries++;
+}
+
+// A bounded lock-free queue for many producers and a single consumer,
+// after Dmitry Vyukov's bounded MPMC queue. Each cell carries a
+// sequence number that says whether it is ready to be filled or
+// to be emptied, so producers only contend on a compare-and-swap
+// of the head and the consumer never synchronizes with anyone.
+
+template <typename T>
+struct ring_queue {
+	struct cell {
+		std::atomic<size_t> seq;
+		T item;
+	};
+
+	cell *cells;
+	size_t limit;
+	size_t mask;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::atomic<bool> closed;
+
+	// Statistics. Producers share the push wait; the rest belong to the consumer.
+	std::atomic<unsigned long long> push_wait_ns;
+	size_t pops = 0;
+	size_t max_depth = 0;
+	double depth_sum = 0;
+	double pop_wait = 0;
+
+	ring_queue(size_t n) {
+		limit = 1;
+		while (limit < n) {
+			limit *= 2;
+		}
+		mask = limit - 1;
+
+		cells = new cell[limit];
+		for (size_t i = 0; i < limit; i++) {
+			cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+
+		head = 0;
+		tail = 0;
+		closed = false;
+		push_wait_ns = 0;
+	}
+
+	~ring_queue() {
+		delete[] cells;
+	}
+
+	bool try_push(T &&item) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		cell *c;
+
+		while (true) {
+			c = &cells[pos & mask];
+			size_t seq = c->seq.load(std::memory_order_acquire);
+			ssize_t dif = (ssize_t) seq - (ssize_t) pos;
+
+			if (dif == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (dif < 0) {
+				return false;  // full
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+
+		c->item = std::move(item);
+		c->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool try_pop(T &item) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		cell *c = &cells[pos & mask];
+		size_t seq = c->seq.load(std::memory_order_acquire);
+
+		if ((ssize_t) seq - (ssize_t)(pos + 1) < 0) {
+			return false;  // empty
+		}
+
+		item = std::move(c->item);
+		c->seq.store(pos + limit, std::memory_order_release);
+		tail.store(pos + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	void push(T &&item) {
+		if (try_push(std::move(item))) {
+			return;
+		}
+
+		double before = pipeline_now();
+		size_t tries = 0;
+		while (!try_push(std::move(item))) {
+			pipeline_backoff(tries);
+		}
+		push_wait_ns += (pipeline_now() - before) * 1e9;
+	}
+
+	// Consumer only: wait for at least one item and then take up to max of them.
+	// Returns false once the queue has been closed and drained.
+	bool pop(std::vector<T> &out, size_t max) {
+		out.clear();
+
+		double before = 0;
+		size_t tries = 0;
+		T item;
+
+		while (true) {
+			size_t depth = head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed);
+
+			while (out.size() < max && try_pop(item)) {
+				out.push_back(std::move(item));
+			}
+
+			if (out.size() > 0) {
+				pops++;
+				depth_sum += depth;
+				if (depth > max_depth) {
+					max_depth = depth;
+				}
+				break;
+			}
+
+			// Producers are finished before the queue is closed,
+			// so it is empty for good if it is still empty now.
+			if (closed.load(std::memory_order_acquire)) {
+				if (try_pop(item)) {
+					out.push_back(std::move(item));
+					continue;
+				}
+				break;
+			}
+
+			if (tries == 0) {
+				before = pipeline_now();
+			}
+			pipeline_backoff(tries);
+		}
+
+		if (tries != 0) {
+			pop_wait += pipeline_now() - before;
+		}
+		return out.size() > 0;
+	}
+
+	void close() {
+		closed.store(true, std::memory_order_release);
+	}
+
+	double push_wait() {
+		return push_wait_ns / 1e9;
+	}
+
+	double average_depth() {
+		if (pops == 0) {
+			return 0;
+		}
+		return depth_sum / pops;
+	}
+};
+
+// Spare buffers handed back by consumers so that producers don't
+// have to allocate (and fault in) a fresh one for every item.
+
+template <typename T>
+struct recycler {
+	std::vector<T> spares;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	void put(T &&item) {
+		pthread_mutex_lock(&lock);
+		spares.push_back(std::move(item));
+		pthread_mutex_unlock(&lock);
+	}
+
+	bool get(T &item) {
+		bool found = false;
+
+		pthread_mutex_lock(&lock);
+		if (spares.size() > 0) {
+			item = std::move(spares.back());
+			spares.pop_back();
+			found = true;
+		}
+		pthread_mutex_unlock(&lock);
+
+		return found;
+	}
+};
+
+#endif
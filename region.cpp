@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <vector>
+#include <utility>
+#include "region.hpp"
+#include "tippecanoe/projection.hpp"
+
+#define WORLD_MAX 0xFFFFFFFFULL
+
+static unsigned long long clamp_world(long long v) {
+	if (v < 0) {
+		return 0;
+	}
+	if (v > (long long) WORLD_MAX) {
+		return WORLD_MAX;
+	}
+	return v;
+}
+
+bool region_add_bbox(region &r, const char *s) {
+	double minlon, minlat, maxlon, maxlat;
+	if (sscanf(s, "%lf,%lf,%lf,%lf", &minlon, &minlat, &maxlon, &maxlat) != 4) {
+		return false;
+	}
+	if (minlon > maxlon || minlat > maxlat) {
+		return false;
+	}
+
+	long long x1, y1, x2, y2;
+	lonlat2tile(minlon, maxlat, 32, &x1, &y1);
+	lonlat2tile(maxlon, minlat, 32, &x2, &y2);
+
+	region_rect rect;
+	rect.x1 = clamp_world(x1);
+	rect.y1 = clamp_world(y1);
+	rect.x2 = clamp_world(x2);
+	rect.y2 = clamp_world(y2);
+	r.rects.push_back(rect);
+
+	return true;
+}
+
+bool region_add_tiles(region &r, const char *s) {
+	while (*s != '\0') {
+		int z;
+		unsigned long long x, y;
+		int used;
+		if (sscanf(s, "%d/%llu/%llu%n", &z, &x, &y, &used) != 3) {
+			return false;
+		}
+		if (z < 0 || z > 32 || x >= (1ULL << z) || y >= (1ULL << z)) {
+			return false;
+		}
+
+		region_rect rect;
+		rect.x1 = x << (32 - z);
+		rect.y1 = y << (32 - z);
+		rect.x2 = ((x + 1) << (32 - z)) - 1;
+		rect.y2 = ((y + 1) << (32 - z)) - 1;
+		r.rects.push_back(rect);
+
+		s += used;
+		if (*s == ',') {
+			s++;
+		} else if (*s != '\0') {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void tile_extent(int z, unsigned long long x, unsigned long long y, region_rect &extent) {
+	extent.x1 = x << (32 - z);
+	extent.y1 = y << (32 - z);
+	extent.x2 = ((x + 1) << (32 - z)) - 1;
+	extent.y2 = ((y + 1) << (32 - z)) - 1;
+}
+
+bool region_intersects(region const &r, int z, long long x, long long y) {
+	if (r.rects.size() == 0) {
+		return true;
+	}
+
+	region_rect extent;
+	tile_extent(z, x, y, extent);
+
+	for (size_t i = 0; i < r.rects.size(); i++) {
+		if (extent.x1 <= r.rects[i].x2 && extent.x2 >= r.rects[i].x1 &&
+		    extent.y1 <= r.rects[i].y2 && extent.y2 >= r.rects[i].y1) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool region_contains(region const &r, int z, unsigned long long x, unsigned long long y) {
+	region_rect extent;
+	tile_extent(z, x, y, extent);
+
+	for (size_t i = 0; i < r.rects.size(); i++) {
+		if (extent.x1 >= r.rects[i].x1 && extent.x2 <= r.rects[i].x2 &&
+		    extent.y1 >= r.rects[i].y1 && extent.y2 <= r.rects[i].y2) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Descends the tile pyramid in quadkey order, stopping at tiles that
+// are entirely inside the region or that have reached zoom `z`
+static void add_ranges(region const &r, int z, int tz, unsigned long long tx, unsigned long long ty, std::vector<std::pair<unsigned long long, unsigned long long>> &out, std::vector<bool> *whole) {
+	if (!region_intersects(r, tz, tx, ty)) {
+		return;
+	}
+
+	bool contained = region_contains(r, tz, tx, ty);
+	if (tz == z || contained) {
+		unsigned long long first = encode(tx << (32 - tz), ty << (32 - tz));
+		unsigned long long last = ULLONG_MAX;
+		if (tz > 0) {
+			last = first | ((1ULL << (2 * (32 - tz))) - 1);
+		}
+
+		if (out.size() > 0 && out.back().second + 1 == first && (whole == NULL || whole->back() == contained)) {
+			out.back().second = last;
+		} else {
+			out.push_back(std::pair<unsigned long long, unsigned long long>(first, last));
+			if (whole != NULL) {
+				whole->push_back(contained);
+			}
+		}
+		return;
+	}
+
+	// The x bit is the more significant of each pair in a quadkey
+	add_ranges(r, z, tz + 1, tx * 2, ty * 2, out, whole);
+	add_ranges(r, z, tz + 1, tx * 2, ty * 2 + 1, out, whole);
+	add_ranges(r, z, tz + 1, tx * 2 + 1, ty * 2, out, whole);
+	add_ranges(r, z, tz + 1, tx * 2 + 1, ty * 2 + 1, out, whole);
+}
+
+std::vector<std::pair<unsigned long long, unsigned long long>> region_key_ranges(region const &r, int z, std::vector<bool> *whole) {
+	std::vector<std::pair<unsigned long long, unsigned long long>> out;
+	if (whole != NULL) {
+		whole->clear();
+	}
+	add_ranges(r, z, 0, 0, 0, out, whole);
+	return out;
+}
+
+// Four zoom levels below the zoom at which the largest rectangle is about one tile
+int region_range_zoom(region const &r) {
+	int z = 32;
+
+	for (size_t i = 0; i < r.rects.size(); i++) {
+		unsigned long long size = r.rects[i].x2 - r.rects[i].x1;
+		if (r.rects[i].y2 - r.rects[i].y1 > size) {
+			size = r.rects[i].y2 - r.rects[i].y1;
+		}
+
+		int rz = 32;
+		while (rz > 0 && (1ULL << (32 - rz)) <= size) {
+			rz--;
+		}
+		if (rz + 4 < z) {
+			z = rz + 4;
+		}
+	}
+
+	return z;
+}
@@ -0,0 +1,37 @@
+#ifndef REGION_HPP
+#define REGION_HPP
+
+#include <vector>
+#include <utility>
+
+// Part of the world, as a list of rectangles in zoom 32 tile coordinates,
+// inclusive at both ends. A region with no rectangles is the whole world.
+
+struct region_rect {
+	unsigned long long x1, y1;
+	unsigned long long x2, y2;
+};
+
+struct region {
+	std::vector<region_rect> rects;
+};
+
+// minlon,minlat,maxlon,maxlat
+bool region_add_bbox(region &r, const char *s);
+
+// z/x/y, or several of them separated by commas
+bool region_add_tiles(region &r, const char *s);
+
+bool region_intersects(region const &r, int z, long long x, long long y);
+
+// The ranges of quadkeys, in order and not overlapping, that cover every
+// tile at zoom `z` that the region touches, and so also every tile deeper
+// than `z` that it touches. If `whole` is given, it is filled in with whether
+// each range is entirely within the region.
+std::vector<std::pair<unsigned long long, unsigned long long>> region_key_ranges(region const &r, int z, std::vector<bool> *whole = NULL);
+
+// A zoom for region_key_ranges() deep enough that the ranges follow the edges
+// of the region closely, but not so deep that a large region has a huge number of them
+int region_range_zoom(region const &r);
+
+#endif
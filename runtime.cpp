@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <vector>
+#include "runtime.hpp"
+
+size_t memory_budget = 0;
+
+// The CPU quota of a cgroup, as the number of CPUs it adds up to, or 0
+// if there is none. Version 2 gives "quota period" in cpu.max; version 1
+// gives them in separate files.
+static size_t cgroup_cpus() {
+	long long quota = -1, period = -1;
+
+	FILE *fp = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%lld %lld", &quota, &period) != 2) {
+			quota = -1;
+		}
+		fclose(fp);
+	} else {
+		fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%lld", &quota) != 1) {
+				quota = -1;
+			}
+			fclose(fp);
+		}
+
+		fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%lld", &period) != 1) {
+				period = -1;
+			}
+			fclose(fp);
+		}
+	}
+
+	if (quota <= 0 || period <= 0) {
+		return 0;
+	}
+	return (quota + period - 1) / period;
+}
+
+size_t available_cpus() {
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t cpus = online > 0 ? online : 1;
+
+#ifdef __linux__
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		size_t allowed = CPU_COUNT(&set);
+		if (allowed > 0 && allowed < cpus) {
+			cpus = allowed;
+		}
+	}
+#endif
+
+	size_t quota = cgroup_cpus();
+	if (quota > 0 && quota < cpus) {
+		cpus = quota;
+	}
+
+	return cpus;
+}
+
+void set_memory_budget(const char *megabytes, const char *argv0) {
+	char *end;
+	double mb = strtod(megabytes, &end);
+	if (*end != '\0' || !(mb > 0)) {
+		fprintf(stderr, "%s: memory budget %s must be a positive number of megabytes\n", argv0, megabytes);
+		exit(EXIT_FAILURE);
+	}
+
+	memory_budget = mb * 1024 * 1024;
+}
+
+size_t budget_count(size_t each, size_t most) {
+	if (memory_budget == 0 || each == 0) {
+		return most;
+	}
+
+	size_t n = memory_budget / each;
+	if (n > most) {
+		n = most;
+	}
+	if (n < 1) {
+		n = 1;
+	}
+	return n;
+}
+
+unsigned char *release_pages(unsigned char *from, unsigned char *to, bool dirty) {
+	static size_t page = sysconf(_SC_PAGESIZE);
+
+	unsigned char *start = (unsigned char *) (((uintptr_t) from + page - 1) / page * page);
+	unsigned char *end = (unsigned char *) ((uintptr_t) to / page * page);
+	if (end <= start) {
+		return from;
+	}
+
+	if (dirty && msync(start, end - start, MS_SYNC) != 0) {
+		perror("msync");
+		exit(EXIT_FAILURE);
+	}
+	if (madvise(start, end - start, MADV_DONTNEED) != 0) {
+		perror("madvise");
+		exit(EXIT_FAILURE);
+	}
+
+	return end;
+}
+
+void report_memory(const char *argv0) {
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0) {
+		perror("getrusage");
+		return;
+	}
+
+#ifdef __APPLE__
+	double peak = ru.ru_maxrss;  // bytes
+#else
+	double peak = ru.ru_maxrss * 1024.0;  // kilobytes
+#endif
+
+	if (memory_budget > 0) {
+		fprintf(stderr, "%s: peak memory %.1f MB of %.1f MB budget\n", argv0, peak / 1024 / 1024, memory_budget / 1024.0 / 1024);
+	} else {
+		fprintf(stderr, "%s: peak memory %.1f MB\n", argv0, peak / 1024 / 1024);
+	}
+}
+
+struct task_pool {
+	void (*fn)(void *arg, size_t task);
+	void *arg;
+	size_t n;
+	std::atomic<size_t> next;
+};
+
+static void *run_pool(void *v) {
+	task_pool *p = (task_pool *) v;
+
+	while (true) {
+		size_t task = p->next++;
+		if (task >= p->n) {
+			break;
+		}
+		p->fn(p->arg, task);
+	}
+
+	return NULL;
+}
+
+void run_tasks(size_t threads, size_t n, void (*fn)(void *arg, size_t task), void *arg) {
+	if (threads > n) {
+		threads = n;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	task_pool p;
+	p.fn = fn;
+	p.arg = arg;
+	p.n = n;
+	p.next = 0;
+
+	// The calling thread is one of the workers
+	std::vector<pthread_t> pthreads(threads - 1);
+	for (size_t i = 0; i < pthreads.size(); i++) {
+		if (pthread_create(&pthreads[i], NULL, run_pool, &p) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	run_pool(&p);
+
+	for (size_t i = 0; i < pthreads.size(); i++) {
+		void *ret;
+		if (pthread_join(pthreads[i], &ret) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+
+#include <stddef.h>
+
+// What the programs share about running within the limits of the
+// machine or container: how many threads to use, how much memory they
+// may take, and a pool of threads to run independent tasks.
+
+// The number of CPUs that the process may run on, from its affinity
+// mask, limited by any cgroup CPU quota
+size_t available_cpus();
+
+// The memory budget in bytes from -m, or 0 if there is none
+extern size_t memory_budget;
+
+// Sets the budget from a number of megabytes, exiting if it isn't positive
+void set_memory_budget(const char *megabytes, const char *argv0);
+
+// How many of something that takes `each` bytes fit within the budget
+// at once, at most `most` and at least 1
+size_t budget_count(size_t each, size_t most);
+
+// Lets the kernel take back the whole pages of a mapped file from `from`
+// up to `to`, writing them first if they are `dirty`, so that a long
+// pass through a mapping does not keep all of it resident. Returns
+// where the next call should start.
+unsigned char *release_pages(unsigned char *from, unsigned char *to, bool dirty);
+
+// Reports the largest resident size the process has reached, and the budget
+void report_memory(const char *argv0);
+
+// Calls fn(arg, i) for each i from 0 to n - 1 on up to `threads` threads,
+// each taking the next task when it finishes the one before, and returns
+// once all of them are done
+void run_tasks(size_t threads, size_t n, void (*fn)(void *arg, size_t task), void *arg);
+
+#endif
@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "tippecanoe/projection.hpp"
+#include "countfile.hpp"
+#include "region.hpp"
+
+// Answers questions about how many points there are in an area, one per line:
+//
+//	tile z/x/y[,z/x/y...]
+//	bbox minlon,minlat,maxlon,maxlat
+//	polygon lon,lat lon,lat lon,lat ...
+//
+// with one line for each, the total of the counts in all the files,
+// or a line beginning with "error:" if the question does not make sense.
+
+std::vector<count_file> files;
+
+void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-u socket] [-B queries] file.count ...\n", argv[0]);
+}
+
+static unsigned long long sum_keys(unsigned long long first, unsigned long long last) {
+	unsigned long long total = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		total += count_sum(files[i], first, last);
+	}
+	return total;
+}
+
+// The total of the counts of the records from `first` to `last` whose
+// locations `inside` says are in the area, for the edges of an area
+template <typename T>
+static unsigned long long sum_keys_within(unsigned long long first, unsigned long long last, T const &inside) {
+	unsigned long long total = 0;
+
+	for (size_t i = 0; i < files.size(); i++) {
+		for (size_t j = count_find(files[i], first); j < files[i].nrecords; j++) {
+			unsigned long long key = count_record_key(files[i], j);
+			if (key > last) {
+				break;
+			}
+
+			unsigned x, y;
+			decode(key, &x, &y);
+			if (inside(x, y)) {
+				total += count_record_count(files[i], j);
+			}
+		}
+	}
+
+	return total;
+}
+
+struct in_region {
+	region const &r;
+
+	in_region(region const &r_)
+	    : r(r_) {
+	}
+
+	bool operator()(unsigned x, unsigned y) const {
+		return region_intersects(r, 32, x, y);
+	}
+};
+
+static unsigned long long sum_region(region const &r) {
+	std::vector<bool> whole;
+	std::vector<std::pair<unsigned long long, unsigned long long>> ranges = region_key_ranges(r, region_range_zoom(r), &whole);
+	unsigned long long total = 0;
+
+	for (size_t i = 0; i < ranges.size(); i++) {
+		if (whole[i]) {
+			total += sum_keys(ranges[i].first, ranges[i].second);
+		} else {
+			total += sum_keys_within(ranges[i].first, ranges[i].second, in_region(r));
+		}
+	}
+
+	return total;
+}
+
+// A polygon, in zoom 32 tile coordinates
+struct polygon {
+	std::vector<double> x;
+	std::vector<double> y;
+
+	// Even-odd rule, so the ring can go either way around
+	bool operator()(double px, double py) const {
+		bool inside = false;
+
+		for (size_t i = 0, j = x.size() - 1; i < x.size(); j = i++) {
+			if ((y[i] > py) != (y[j] > py) &&
+			    px < (x[j] - x[i]) * (py - y[i]) / (y[j] - y[i]) + x[i]) {
+				inside = !inside;
+			}
+		}
+
+		return inside;
+	}
+};
+
+// Whether the segment from x1,y1 to x2,y2 touches the rectangle, by clipping it to each edge in turn
+static bool segment_touches(double x1, double y1, double x2, double y2, double rx1, double ry1, double rx2, double ry2) {
+	double t0 = 0, t1 = 1;
+	double dx = x2 - x1, dy = y2 - y1;
+	double p[4] = {-dx, dx, -dy, dy};
+	double q[4] = {x1 - rx1, rx2 - x1, y1 - ry1, ry2 - y1};
+
+	for (size_t i = 0; i < 4; i++) {
+		if (p[i] == 0) {
+			if (q[i] < 0) {
+				return false;
+			}
+		} else {
+			double t = q[i] / p[i];
+			if (p[i] < 0) {
+				t0 = std::max(t0, t);
+			} else {
+				t1 = std::min(t1, t);
+			}
+			if (t0 > t1) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+enum overlap {
+	overlap_none,
+	overlap_whole,
+	overlap_edge,
+};
+
+static overlap polygon_overlap(polygon const &p, int z, unsigned long long tx, unsigned long long ty) {
+	double x1 = tx << (32 - z);
+	double y1 = ty << (32 - z);
+	double x2 = (tx + 1) << (32 - z);
+	double y2 = (ty + 1) << (32 - z);
+
+	for (size_t i = 0, j = p.x.size() - 1; i < p.x.size(); j = i++) {
+		if (segment_touches(p.x[j], p.y[j], p.x[i], p.y[i], x1, y1, x2, y2)) {
+			return overlap_edge;
+		}
+	}
+
+	// No edge crosses the tile, so it is all inside or all outside
+	if (p((x1 + x2) / 2, (y1 + y2) / 2)) {
+		return overlap_whole;
+	}
+	return overlap_none;
+}
+
+struct in_polygon {
+	polygon const &p;
+
+	in_polygon(polygon const &p_)
+	    : p(p_) {
+	}
+
+	bool operator()(unsigned x, unsigned y) const {
+		return p(x, y);
+	}
+};
+
+// Descends the tile pyramid, summing the tiles that are entirely inside the polygon,
+// until it reaches `maxzoom`, where the records along the edges are checked one by one
+static unsigned long long sum_polygon(polygon const &p, int maxzoom, int z, unsigned long long tx, unsigned long long ty) {
+	overlap o = polygon_overlap(p, z, tx, ty);
+	if (o == overlap_none) {
+		return 0;
+	}
+
+	unsigned long long first = encode(tx << (32 - z), ty << (32 - z));
+	unsigned long long last = ULLONG_MAX;
+	if (z > 0) {
+		last = first | ((1ULL << (2 * (32 - z))) - 1);
+	}
+
+	if (o == overlap_whole) {
+		return sum_keys(first, last);
+	}
+	if (z == maxzoom) {
+		return sum_keys_within(first, last, in_polygon(p));
+	}
+
+	return sum_polygon(p, maxzoom, z + 1, tx * 2, ty * 2) +
+	       sum_polygon(p, maxzoom, z + 1, tx * 2, ty * 2 + 1) +
+	       sum_polygon(p, maxzoom, z + 1, tx * 2 + 1, ty * 2) +
+	       sum_polygon(p, maxzoom, z + 1, tx * 2 + 1, ty * 2 + 1);
+}
+
+static bool parse_polygon(const char *s, polygon &p) {
+	while (*s != '\0') {
+		double lon, lat;
+		int used;
+		if (sscanf(s, " %lf,%lf%n", &lon, &lat, &used) != 2) {
+			return false;
+		}
+		s += used;
+		while (*s == ' ') {
+			s++;
+		}
+
+		long long x, y;
+		lonlat2tile(lon, lat, 32, &x, &y);
+		p.x.push_back(x);
+		p.y.push_back(y);
+	}
+
+	return p.x.size() >= 3;
+}
+
+std::string answer(const char *query) {
+	const char *space = strchr(query, ' ');
+	if (space == NULL) {
+		return "error: no area given";
+	}
+	std::string what(query, space - query);
+	const char *area = space + 1;
+
+	if (what == "tile" || what == "bbox") {
+		region r;
+		if (what == "tile" && !region_add_tiles(r, area)) {
+			return "error: not a list of z/x/y tiles";
+		}
+		if (what == "bbox" && !region_add_bbox(r, area)) {
+			return "error: not minlon,minlat,maxlon,maxlat";
+		}
+
+		return std::to_string(sum_region(r));
+	}
+
+	if (what == "polygon") {
+		polygon p;
+		if (!parse_polygon(area, p)) {
+			return "error: not a list of at least three lon,lat points";
+		}
+
+		// The edges of the polygon are followed to the same depth
+		// as the edges of its bounding box would be
+		region bounds;
+		region_rect rect;
+		rect.x1 = std::max(0.0, *std::min_element(p.x.begin(), p.x.end()));
+		rect.y1 = std::max(0.0, *std::min_element(p.y.begin(), p.y.end()));
+		rect.x2 = std::min(4294967295.0, *std::max_element(p.x.begin(), p.x.end()));
+		rect.y2 = std::min(4294967295.0, *std::max_element(p.y.begin(), p.y.end()));
+		bounds.rects.push_back(rect);
+
+		return std::to_string(sum_polygon(p, region_range_zoom(bounds), 0, 0, 0));
+	}
+
+	return "error: unknown query " + what;
+}
+
+void serve(FILE *in, FILE *out) {
+	char *line = NULL;
+	size_t len = 0;
+
+	while (getline(&line, &len, in) >= 0) {
+		size_t n = strlen(line);
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+			line[--n] = '\0';
+		}
+		if (n == 0) {
+			continue;
+		}
+
+		std::string s = answer(line) + "\n";
+		if (fputs(s.c_str(), out) == EOF || fflush(out) != 0) {
+			break;
+		}
+	}
+
+	free(line);
+}
+
+void *run_connection(void *v) {
+	int fd = (int) (intptr_t) v;
+
+	FILE *in = fdopen(fd, "r");
+	FILE *out = fdopen(dup(fd), "w");
+	if (in == NULL || out == NULL) {
+		perror("fdopen");
+		exit(EXIT_FAILURE);
+	}
+
+	serve(in, out);
+	fclose(in);
+	fclose(out);
+	return NULL;
+}
+
+void serve_socket(const char *path) {
+	// Replace a socket left behind by an earlier server, but nothing else
+	struct stat st;
+	if (stat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s already exists and is not a socket\n", path);
+			exit(EXIT_FAILURE);
+		}
+		unlink(path);
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket name is too long\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (listen(s, 64) != 0) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+
+	// A client that goes away before its answer is written is not an error
+	signal(SIGPIPE, SIG_IGN);
+
+	while (true) {
+		int fd = accept(s, NULL, NULL);
+		if (fd < 0) {
+			perror("accept");
+			continue;
+		}
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, run_connection, (void *) (intptr_t) fd) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(thread);
+	}
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, std::vector<double> &times) {
+	if (times.size() == 0) {
+		return;
+	}
+
+	std::sort(times.begin(), times.end());
+	double sum = 0;
+	for (size_t i = 0; i < times.size(); i++) {
+		sum += times[i];
+	}
+
+	printf("%-8s %zu queries: mean %.1f us, median %.1f us, 99th percentile %.1f us, max %.1f us\n", what, times.size(),
+	       sum / times.size() * 1e6, times[times.size() / 2] * 1e6, times[times.size() * 99 / 100] * 1e6, times.back() * 1e6);
+}
+
+// Times queries for tiles and bounding boxes around locations
+// chosen at random from the first file
+void benchmark(size_t n) {
+	if (files[0].nrecords == 0) {
+		fprintf(stderr, "%s: no records to choose locations from\n", files[0].name.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<std::string> tiles, bboxes;
+	for (size_t i = 0; i < n; i++) {
+		unsigned x, y;
+		decode(count_record_key(files[0], rand() % files[0].nrecords), &x, &y);
+
+		int z = rand() % 19;
+		unsigned long long tx = x, ty = y;
+		tiles.push_back("tile " + std::to_string(z) + "/" + std::to_string(tx >> (32 - z)) + "/" + std::to_string(ty >> (32 - z)));
+
+		double lon, lat;
+		tile2lonlat(x, y, 32, &lon, &lat);
+		double size = 0.001 * (1 << (rand() % 10));
+		bboxes.push_back("bbox " + std::to_string(lon - size) + "," + std::to_string(lat - size) + "," + std::to_string(lon + size) + "," + std::to_string(lat + size));
+	}
+
+	std::vector<double> times;
+	for (size_t i = 0; i < n; i++) {
+		double before = now();
+		answer(tiles[i].c_str());
+		times.push_back(now() - before);
+	}
+	report("tile", times);
+
+	times.clear();
+	for (size_t i = 0; i < n; i++) {
+		double before = now();
+		answer(bboxes[i].c_str());
+		times.push_back(now() - before);
+	}
+	report("bbox", times);
+}
+
+int main(int argc, char **argv) {
+	extern int optind;
+	extern char *optarg;
+
+	const char *socket_path = NULL;
+	size_t bench = 0;
+
+	int i;
+	while ((i = getopt(argc, argv, "u:B:")) != -1) {
+		switch (i) {
+		case 'u':
+			socket_path = optarg;
+			break;
+
+		case 'B':
+			bench = atoll(optarg);
+			break;
+
+		default:
+			usage(argv);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+
+	files.resize(argc - optind);
+	for (size_t j = 0; j < files.size(); j++) {
+		count_open(files[j], argv[optind + j]);
+	}
+
+	if (bench != 0) {
+		benchmark(bench);
+	} else if (socket_path != NULL) {
+		serve_socket(socket_path);
+	} else {
+		serve(stdin, stdout);
+	}
+
+	for (size_t j = 0; j < files.size(); j++) {
+		count_close(files[j]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+// Checks that a tile archive written with tile-count-tile -E is laid out
+// as output.hpp describes, and that it has the same tiles as an mbtiles
+// made with the same options.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include "output.hpp"
+#include "serial.hpp"
+
+static void fail(const char *fname, const char *why) {
+	fprintf(stderr, "%s: %s\n", fname, why);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s file.archive file.mbtiles\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		perror(argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	std::string archive;
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, sizeof(char), sizeof(buf), fp)) > 0) {
+		archive.append(buf, n);
+	}
+	fclose(fp);
+
+	if (archive.size() < ARCHIVE_MAGIC_LEN + ARCHIVE_TRAILER_BYTES ||
+	    memcmp(archive.data(), ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN) != 0 ||
+	    memcmp(archive.data() + archive.size() - ARCHIVE_MAGIC_LEN, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN) != 0) {
+		fail(argv[1], "not a tile archive");
+	}
+
+	unsigned char *data = (unsigned char *) &archive[0];
+	unsigned char *trailer = data + archive.size() - ARCHIVE_TRAILER_BYTES;
+	unsigned long long index_offset = read64(trailer);
+	unsigned long long entries = read64(trailer + 8);
+	unsigned long long meta_offset = read64(trailer + 16);
+	unsigned long long meta_length = read64(trailer + 24);
+
+	if (index_offset + entries * ARCHIVE_INDEX_BYTES != meta_offset ||
+	    meta_offset + meta_length != archive.size() - ARCHIVE_TRAILER_BYTES) {
+		fail(argv[1], "index and metadata are not where the trailer says");
+	}
+	std::string meta(archive, meta_offset, meta_length);
+	while (!meta.empty() && meta.back() == '\n') {
+		meta.pop_back();
+	}
+	if (meta.empty() || meta.front() != '{' || meta.back() != '}') {
+		fail(argv[1], "metadata is not a JSON object");
+	}
+
+	sqlite3 *db;
+	if (sqlite3_open_v2(argv[2], &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", argv[2], sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, "SELECT count(*) FROM tiles;", -1, &stmt, NULL) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+		fprintf(stderr, "%s: %s\n", argv[2], sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+	unsigned long long tiles = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if (tiles != entries) {
+		fprintf(stderr, "%s has %llu tiles, but %s has %llu\n", argv[1], entries, argv[2], tiles);
+		exit(EXIT_FAILURE);
+	}
+
+	if (sqlite3_prepare_v2(db, "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?;", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", argv[2], sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+
+	archive_entry prev = archive_entry();
+	for (unsigned long long i = 0; i < entries; i++) {
+		unsigned char *p = data + index_offset + i * ARCHIVE_INDEX_BYTES;
+
+		archive_entry e;
+		e.z = read32(p);
+		e.x = read32(p + 4);
+		e.y = read32(p + 8);
+		e.offset = read64(p + 12);
+		e.length = read32(p + 20);
+
+		if (i > 0 && !(prev < e)) {
+			fail(argv[1], "index is not in z/x/y order");
+		}
+		prev = e;
+
+		if (e.offset < ARCHIVE_MAGIC_LEN || e.offset + e.length > index_offset) {
+			fail(argv[1], "tile is outside the tile data");
+		}
+
+		sqlite3_reset(stmt);
+		sqlite3_bind_int(stmt, 1, e.z);
+		sqlite3_bind_int(stmt, 2, e.x);
+		sqlite3_bind_int(stmt, 3, (1LL << e.z) - 1 - e.y);
+
+		if (sqlite3_step(stmt) != SQLITE_ROW ||
+		    (unsigned long long) sqlite3_column_bytes(stmt, 0) != e.length ||
+		    memcmp(sqlite3_column_blob(stmt, 0), data + e.offset, e.length) != 0) {
+			fprintf(stderr, "%s: tile %u/%u/%u is not the same as in %s\n", argv[1], e.z, e.x, e.y, argv[2]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return 0;
+}
@@ -0,0 +1,227 @@
+// Checks the quadkey encode() and decode() in tippecanoe/projection.hpp
+// against the original bit-at-a-time versions, and with -b, times them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tippecanoe/projection.hpp"
+
+static unsigned long long reference_encode(unsigned int wx, unsigned int wy) {
+	unsigned long long out = 0;
+
+	for (int i = 0; i < 32; i++) {
+		unsigned long long v = ((wx >> (32 - (i + 1))) & 1) << 1;
+		v |= (wy >> (32 - (i + 1))) & 1;
+		v = v << (64 - 2 * (i + 1));
+
+		out |= v;
+	}
+
+	return out;
+}
+
+static unsigned char decodex[256];
+static unsigned char decodey[256];
+
+static void reference_decode(unsigned long long index, unsigned *wx, unsigned *wy) {
+	static bool initialized = false;
+	if (!initialized) {
+		for (size_t ix = 0; ix < 256; ix++) {
+			size_t xx = 0, yy = 0;
+
+			for (size_t i = 0; i < 32; i++) {
+				xx |= ((ix >> (64 - 2 * (i + 1) + 1)) & 1) << (32 - (i + 1));
+				yy |= ((ix >> (64 - 2 * (i + 1) + 0)) & 1) << (32 - (i + 1));
+			}
+
+			decodex[ix] = xx;
+			decodey[ix] = yy;
+		}
+
+		initialized = true;
+	}
+
+	*wx = *wy = 0;
+
+	for (size_t i = 0; i < 8; i++) {
+		*wx |= ((unsigned) decodex[(index >> (8 * i)) & 0xFF]) << (4 * i);
+		*wy |= ((unsigned) decodey[(index >> (8 * i)) & 0xFF]) << (4 * i);
+	}
+}
+
+static unsigned long long state = 88172645463325252ULL;
+
+static unsigned long long xorshift() {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static size_t failures = 0;
+
+static void check(unsigned wx, unsigned wy) {
+	unsigned long long want = reference_encode(wx, wy);
+
+	unsigned rx, ry;
+	reference_decode(want, &rx, &ry);
+	if (rx != wx || ry != wy) {
+		fprintf(stderr, "the reference implementations disagree about %x,%x\n", wx, wy);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned long long got = encode(wx, wy);
+	if (got != want) {
+		if (failures++ < 10) {
+			fprintf(stderr, "encode(%x, %x): got %llx, wanted %llx\n", wx, wy, got, want);
+		}
+	}
+
+	unsigned long long masks = (morton_spread_masks(wx) << 1) | morton_spread_masks(wy);
+	if (masks != want) {
+		if (failures++ < 10) {
+			fprintf(stderr, "masks encode(%x, %x): got %llx, wanted %llx\n", wx, wy, masks, want);
+		}
+	}
+
+	unsigned x, y;
+	decode(want, &x, &y);
+	if (x != wx || y != wy) {
+		if (failures++ < 10) {
+			fprintf(stderr, "decode(%llx): got %x,%x, wanted %x,%x\n", want, x, y, wx, wy);
+		}
+	}
+
+	if (morton_squeeze_masks(want >> 1) != wx || morton_squeeze_masks(want) != wy) {
+		if (failures++ < 10) {
+			fprintf(stderr, "masks decode(%llx) is wrong\n", want);
+		}
+	}
+
+#ifdef MORTON_BMI2
+	if (morton_bmi2) {
+		if (((morton_spread_bmi2(wx) << 1) | morton_spread_bmi2(wy)) != want ||
+		    morton_squeeze_bmi2(want >> 1) != wx || morton_squeeze_bmi2(want) != wy) {
+			if (failures++ < 10) {
+				fprintf(stderr, "bmi2 encode or decode of %x,%x is wrong\n", wx, wy);
+			}
+		}
+	}
+#endif
+}
+
+static void test() {
+	// Every pair of single bits, and of all-but-one bits
+	for (int i = 0; i < 32; i++) {
+		for (int j = 0; j < 32; j++) {
+			check(1U << i, 1U << j);
+			check(~(1U << i), ~(1U << j));
+			check(1U << i, ~(1U << j));
+		}
+	}
+
+	// Every value of the low 12 bits of each, with and without high bits
+	for (unsigned i = 0; i < 4096; i++) {
+		for (unsigned j = 0; j < 4096; j += 7) {
+			check(i, j);
+			check(i << 20, ~j);
+		}
+	}
+
+	for (size_t i = 0; i < 10000000; i++) {
+		unsigned long long r = xorshift();
+		check(r >> 32, r & 0xFFFFFFFF);
+	}
+
+	// Keys that were not made by encode() still decode the same way
+	for (size_t i = 0; i < 1000000; i++) {
+		unsigned long long key = xorshift();
+		unsigned x, y, rx, ry;
+		decode(key, &x, &y);
+		reference_decode(key, &rx, &ry);
+		if (x != rx || y != ry) {
+			if (failures++ < 10) {
+				fprintf(stderr, "decode(%llx): got %x,%x, wanted %x,%x\n", key, x, y, rx, ry);
+			}
+		}
+	}
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_N 50000000
+
+template <typename F>
+static void bench(const char *name, F f) {
+	state = 88172645463325252ULL;
+	unsigned long long sum = 0;
+
+	double before = now();
+	for (size_t i = 0; i < BENCH_N; i++) {
+		sum += f(xorshift());
+	}
+	double elapsed = now() - before;
+
+	printf("%-20s %6.2f ns/op  (%llx)\n", name, elapsed * 1e9 / BENCH_N, sum);
+}
+
+static void benchmark() {
+	bench("xorshift only", [](unsigned long long r) {
+		return r;
+	});
+	bench("encode reference", [](unsigned long long r) {
+		return reference_encode(r >> 32, r);
+	});
+	bench("encode masks", [](unsigned long long r) {
+		return (morton_spread_masks(r >> 32) << 1) | morton_spread_masks(r);
+	});
+	bench("decode reference", [](unsigned long long r) {
+		unsigned x, y;
+		reference_decode(r, &x, &y);
+		return (unsigned long long) x + y;
+	});
+	bench("decode masks", [](unsigned long long r) {
+		return (unsigned long long) morton_squeeze_masks(r >> 1) + morton_squeeze_masks(r);
+	});
+
+#ifdef MORTON_BMI2
+	if (morton_bmi2) {
+		bench("encode bmi2", [](unsigned long long r) {
+			return (morton_spread_bmi2(r >> 32) << 1) | morton_spread_bmi2(r);
+		});
+		bench("decode bmi2", [](unsigned long long r) {
+			return (unsigned long long) morton_squeeze_bmi2(r >> 1) + morton_squeeze_bmi2(r);
+		});
+	}
+#endif
+
+	bench("encode", [](unsigned long long r) {
+		return encode(r >> 32, r);
+	});
+	bench("decode", [](unsigned long long r) {
+		unsigned x, y;
+		decode(r, &x, &y);
+		return (unsigned long long) x + y;
+	});
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		benchmark();
+		return 0;
+	}
+
+	test();
+
+	if (failures != 0) {
+		fprintf(stderr, "%zu failures\n", failures);
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
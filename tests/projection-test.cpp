@@ -0,0 +1,132 @@
+// Checks that lonlat2tile_batch() projects exactly as lonlat2tile() does,
+// and with -b, times them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include "tippecanoe/projection.hpp"
+
+static unsigned long long state = 88172645463325252ULL;
+
+static double uniform(double lo, double hi) {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return lo + (hi - lo) * (state >> 11) / (double) (1ULL << 53);
+}
+
+static size_t failures = 0;
+
+static void check(std::vector<double> const &lon, std::vector<double> const &lat) {
+	std::vector<long long> x(lon.size()), y(lon.size());
+	lonlat2tile_batch(lon.size(), lon.data(), lat.data(), x.data(), y.data());
+
+	for (size_t i = 0; i < lon.size(); i++) {
+		long long wx, wy;
+		lonlat2tile(lon[i], lat[i], 32, &wx, &wy);
+
+		if (x[i] != wx || y[i] != wy) {
+			if (failures++ < 10) {
+				fprintf(stderr, "%.17g,%.17g: got %lld,%lld, wanted %lld,%lld\n", lon[i], lat[i], x[i], y[i], wx, wy);
+			}
+		}
+	}
+}
+
+static void test() {
+	std::vector<double> lon, lat;
+
+	// Random points over the whole plane and beyond its edges
+	for (size_t i = 0; i < 5000000; i++) {
+		lon.push_back(uniform(-200, 200));
+		lat.push_back(uniform(-90, 90));
+	}
+	check(lon, lat);
+
+	// Points near the top and bottom edges of the plane, and near the equator
+	lon.clear();
+	lat.clear();
+	for (size_t i = 0; i < 1000000; i++) {
+		lon.push_back(uniform(-180, 180));
+		lat.push_back(uniform(85.0, 85.1));
+		lon.push_back(uniform(-180, 180));
+		lat.push_back(uniform(-85.1, -85.0));
+		lon.push_back(uniform(-180, 180));
+		lat.push_back(uniform(-1e-6, 1e-6));
+	}
+	check(lon, lat);
+
+	// The corners, the poles, and coordinates that aren't numbers
+	double special[] = {-360, -180, -90, -89.9, -85.0511287798066, -45, 0, 45, 85.0511287798066, 89.9, 90, 180, 360, 1e300, -1e300, INFINITY, -INFINITY, NAN};
+	size_t nspecial = sizeof(special) / sizeof(special[0]);
+	lon.clear();
+	lat.clear();
+	for (size_t i = 0; i < nspecial; i++) {
+		for (size_t j = 0; j < nspecial; j++) {
+			lon.push_back(special[i]);
+			lat.push_back(special[j]);
+		}
+	}
+	check(lon, lat);
+
+	// Every tile edge at zoom 12
+	lon.clear();
+	lat.clear();
+	for (long long t = 0; t <= 4096; t++) {
+		double elon, elat;
+		tile2lonlat(t, t, 12, &elon, &elat);
+		lon.push_back(elon);
+		lat.push_back(elat);
+	}
+	check(lon, lat);
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_N 10000000
+#define BENCH_BATCH 4096
+
+static void benchmark() {
+	std::vector<double> lon, lat;
+	for (size_t i = 0; i < BENCH_N; i++) {
+		lon.push_back(uniform(-180, 180));
+		lat.push_back(uniform(-85, 85));
+	}
+	std::vector<long long> x(BENCH_N), y(BENCH_N);
+
+	double before = now();
+	for (size_t i = 0; i < BENCH_N; i++) {
+		lonlat2tile(lon[i], lat[i], 32, &x[i], &y[i]);
+	}
+	printf("lonlat2tile         %6.2f ns/point\n", (now() - before) * 1e9 / BENCH_N);
+
+	before = now();
+	for (size_t i = 0; i < BENCH_N; i += BENCH_BATCH) {
+		size_t n = BENCH_N - i < BENCH_BATCH ? BENCH_N - i : BENCH_BATCH;
+		lonlat2tile_batch(n, lon.data() + i, lat.data() + i, x.data() + i, y.data() + i);
+	}
+	printf("lonlat2tile_batch   %6.2f ns/point\n", (now() - before) * 1e9 / BENCH_N);
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		benchmark();
+		return 0;
+	}
+
+	test();
+
+	if (failures != 0) {
+		fprintf(stderr, "%zu failures\n", failures);
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
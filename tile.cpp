@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <sqlite3.h>
 #include <sys/stat.h>
@@ -8,6 +9,7 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <list>
 #include <queue>
 #include <algorithm>
 #include <fcntl.h>
@@ -26,6 +28,11 @@
 #include "serial.hpp"
 #include "tippecanoe/mvt.hpp"
 #include "tippecanoe/mbtiles.hpp"
+#include "pipeline.hpp"
+#include "output.hpp"
+#include "region.hpp"
+#include "countfile.hpp"
+#include "runtime.hpp"
 
 int levels = 50;
 int first_level = 0;
@@ -43,13 +50,29 @@ bool increment_threshold = false;
 bool points = false;
 
 bool quiet = false;
+bool report_timing = false;
+bool deduplicate = false;
+int compression_level = -1;  // zlib's default for PNG, and best for vectors
+int png_filter = -1;         // libpng's default
 bool include_density = false;
 bool include_count = false;
+region tile_region;  // if not empty, only the tiles that touch it are made
+
+// For incremental re-tiling: the first quadkey of each maxzoom tile whose
+// records changed, in order, and the zooms whose normalization changed
+// too much for their other tiles to be kept
+bool incremental = false;
+double max_density_tolerance = 0.05;
+std::vector<unsigned long long> changed_tiles;
+std::vector<bool> whole_zoom;
 
 #define MAX_TILE_SIZE 500000
+#define WRITER_BATCH 1000
+#define TILES_PER_TRANSACTION 5000
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s [options] -o out.mbtiles file.count\n", argv[0]);
+	fprintf(stderr, "Usage: %s [options] [--memory megabytes] [--bbox minlon,minlat,maxlon,maxlat] [--tiles z/x/y] -o out.mbtiles | -e directory | -E archive file.count\n", argv[0]);
+	fprintf(stderr, "       %s [options] [--max-density list | in.mbtiles] [--cache tiles] --render z/x/y | --serve file.count\n", argv[0]);
 }
 
 struct tile {
@@ -68,15 +91,190 @@ struct tile {
 	}
 };
 
+// The density level that a bin with `count` points is quantized to,
+// before brightening
+long long count_density(long long count, long long zoom_max) {
+	return exp(log(exp(log(levels) * count_gamma) * count / zoom_max) / count_gamma);
+}
+
+// The (approximate) count that a density level stands for
+long long density_count(double density, double gamma, long long zoom_max, double density_levels) {
+	return ceil(exp(log(density) * gamma) * zoom_max / exp(log(density_levels) * gamma));
+}
+
+long long brighten_density(long long density) {
+	density *= brighten;
+	if (density > levels - 1) {
+		density = levels - 1;
+	}
+	return density;
+}
+
+// Quantizing a bin is monotonic in its count, so for each zoom level the
+// levels can be found once as the smallest count that reaches each of them,
+// and then each bin only needs a search of that table instead of a chain
+// of exp() and log(). The cutoffs come from the same expression, so the
+// densities are identical.
+
+struct density_table {
+	long long zoom_max;
+	bool tabulated;
+
+	std::vector<long long> cutoff;      // smallest count for each level, padded to a power of 2
+	std::vector<long long> brightened;  // brightened and clipped density of each level
+	std::vector<long long> counts;      // count that each output level stands for
+
+	density_table(long long max) {
+		zoom_max = max;
+
+		for (int i = 0; i < levels; i++) {
+			counts.push_back(density_count(i, count_gamma, zoom_max, levels));
+		}
+
+		// Levels beyond `top` all brighten to the top output level
+		// and are all above the minimum level.
+		long long top = 0;
+		while (brighten_density(top) < levels - 1 || top < first_level) {
+			top++;
+
+			if (brighten <= 0 || top > 65536) {
+				tabulated = false;
+				return;
+			}
+		}
+		tabulated = true;
+
+		cutoff.push_back(0);
+		for (long long d = 1; d <= top; d++) {
+			cutoff.push_back(find_cutoff(d));
+		}
+		size_t n = 1;
+		while (n < cutoff.size()) {
+			n *= 2;
+		}
+		cutoff.resize(n, LLONG_MAX);
+
+		for (long long d = 0; d <= top; d++) {
+			brightened.push_back(brighten_density(d));
+		}
+	}
+
+	long long find_cutoff(long long d) {
+		long long lo = 0;  // below the cutoff
+		long long hi = 1;  // at or above the cutoff
+		while (count_density(hi, zoom_max) < d) {
+			if (hi > (LLONG_MAX >> 2)) {
+				return LLONG_MAX;
+			}
+
+			lo = hi;
+			hi *= 2;
+		}
+
+		while (hi - lo > 1) {
+			long long mid = lo + (hi - lo) / 2;
+			if (count_density(mid, zoom_max) >= d) {
+				hi = mid;
+			} else {
+				lo = mid;
+			}
+		}
+
+		return hi;
+	}
+
+	// The unbrightened level of a positive count, except that
+	// all levels past the top of the table are reported as the top.
+	long long level(long long count) const {
+		if (!tabulated) {
+			return count_density(count, zoom_max);
+		}
+
+		// Branch-free binary search for the last cutoff <= count
+		const long long *base = cutoff.data();
+		size_t n = cutoff.size();
+		while (n > 1) {
+			size_t half = n / 2;
+			base = (base[half] <= count) ? base + half : base;
+			n -= half;
+		}
+		return base - cutoff.data();
+	}
+
+	long long density(long long level) const {
+		if (!tabulated) {
+			return brighten_density(level);
+		}
+		return brightened[level];
+	}
+};
+
+std::vector<density_table> make_density_tables(std::vector<long long> const &zoom_max) {
+	std::vector<density_table> out;
+	for (size_t z = 0; z < zoom_max.size(); z++) {
+		out.push_back(density_table(zoom_max[z]));
+	}
+	return out;
+}
+
+struct encoded_tile {
+	int z;
+	long long x;
+	long long y;
+	std::string data;
+};
+
+// All output goes through a single writer thread so that the
+// encoding threads never contend for the database connection.
+
+struct tile_writer {
+	tile_output *out;
+	ring_queue<encoded_tile> queue;
+	pthread_t thread;
+
+	size_t tiles = 0;
+	size_t batches = 0;
+	size_t bytes = 0;
+	size_t duplicates = 0;
+	double busy = 0;
+	double elapsed = 0;
+
+	tile_writer(tile_output *o, size_t depth)
+	    : queue(depth) {
+		out = o;
+	}
+
+	void write(int z, long long x, long long y, std::string &&data) {
+		if (data.size() == 0) {
+			return;
+		}
+
+		encoded_tile et;
+		et.z = z;
+		et.x = x;
+		et.y = y;
+		et.data = std::move(data);
+		queue.push(std::move(et));
+	}
+};
+
+// Ranges of record numbers, each from the first to just past the last
+typedef std::vector<std::pair<size_t, size_t>> record_spans;
+
 struct tiler {
 	std::vector<tile> tiles;
 	std::vector<tile> partial_tiles;
-	std::vector<long long> max;       // for this thread
-	std::vector<long long> zoom_max;  // global on 2nd pass
+	std::vector<long long> max;  // for this thread
 	size_t pass;
 	size_t start;
 	size_t end;
+	record_spans spans;  // the records from start to end that are to be read
 	long long bbox[4];
+
+	// The range of quadkeys that belongs to this shard and no other,
+	// so that tiles entirely within it are complete
+	unsigned long long shard_first;
+	unsigned long long shard_last;
 	long long midx, midy;
 	long long atmid;
 
@@ -84,14 +282,14 @@ struct tiler {
 	size_t minzoom;
 	size_t zooms;
 	size_t detail;
-	sqlite3 *outdb;
+	bounded_queue<tile> *grids;
+	recycler<std::vector<long long>> *spares;
 	int maxzoom;
+	double elapsed;
 
 	std::atomic<int> *progress;
 	size_t shard;
 	size_t cpus;
-	std::string layername;
-	std::map<std::string, layermap_entry> *layermap;
 };
 
 void gather_quantile(tile const &tile, int detail, long long &max) {
@@ -108,7 +306,7 @@ void gather_quantile(tile const &tile, int detail, long long &max) {
 
 void string_append(png_structp png_ptr, png_bytep data, png_size_t length) {
 	std::string *s = (std::string *) png_get_io_ptr(png_ptr);
-	s->append(std::string(data, data + length));
+	s->append((char const *) data, length);
 }
 
 static void fail(png_structp png_ptr, png_const_charp error_msg) {
@@ -116,21 +314,365 @@ static void fail(png_structp png_ptr, png_const_charp error_msg) {
 	exit(EXIT_FAILURE);
 }
 
-void make_tile(sqlite3 *outdb, tile &otile, int z, int detail, long long zoom_max, std::string const &layername, std::map<std::string, layermap_entry> *layermap) {
+// Reusable buffers for encoding tiles, one set for each thread
+// that calls make_tile(), so that they don't have to be allocated
+// again for every tile
+struct tile_buffers {
+	std::vector<long long> normalized;
+	std::string uncompressed;
+
+	mvt_zlib zlib{compression_level < 0 ? Z_BEST_COMPRESSION : compression_level};
+	size_t compressed = 0;
+	double compressing = 0;
+
+	std::string pbf;
+	std::string layer;
+	std::string features;
+	std::string feature;
+	std::string value;
+
+	// The geometry of the single feature for each density level,
+	// and where the cursor was left at the end of it
+	std::vector<std::vector<uint32_t>> geometries;
+	std::vector<std::pair<long long, long long>> cursors;
+
+	// The palette for bitmap tiles, and their pixels, row after row
+	std::vector<png_color> colors;
+	std::vector<png_byte> transparency;
+	std::vector<png_byte> pixels;
+	std::vector<png_bytep> rows;
+	size_t png_size = 0;
+
+	// The layer's constant pool. Every value is an mvt_uint.
+	std::vector<unsigned long long> values;
+	std::map<unsigned long long, unsigned> value_index;
+
+	unsigned tag(unsigned long long v) {
+		auto vi = value_index.find(v);
+		if (vi != value_index.end()) {
+			return vi->second;
+		}
+
+		unsigned vo = values.size();
+		values.push_back(v);
+		value_index.insert(std::pair<unsigned long long, unsigned>(v, vo));
+		return vo;
+	}
+};
+
+// Append the unit square with its top left corner at x,y (or a point
+// at that corner) to a geometry whose cursor is at px,py, encoded as
+// mvt_tile::encode() would encode the equivalent mvt_geometry.
+static void add_bin(std::vector<uint32_t> &geometry, long long x, long long y, long long &px, long long &py) {
+	if (points) {
+		geometry.push_back(protozero::encode_zigzag32(x - px));
+		geometry.push_back(protozero::encode_zigzag32(y - py));
+		px = x;
+		py = y;
+	} else {
+		geometry.push_back((1 << 3) | mvt_moveto);
+		geometry.push_back(protozero::encode_zigzag32(x - px));
+		geometry.push_back(protozero::encode_zigzag32(y - py));
+		geometry.push_back((3 << 3) | mvt_lineto);
+		geometry.push_back(protozero::encode_zigzag32(1));
+		geometry.push_back(protozero::encode_zigzag32(0));
+		geometry.push_back(protozero::encode_zigzag32(0));
+		geometry.push_back(protozero::encode_zigzag32(1));
+		geometry.push_back(protozero::encode_zigzag32(-1));
+		geometry.push_back(protozero::encode_zigzag32(0));
+		geometry.push_back((1 << 3) | mvt_closepath);
+		px = x;
+		py = y + 1;
+	}
+}
+
+static void add_feature(tile_buffers &buffers, std::vector<uint32_t> &geometry, unsigned long long density, unsigned long long count) {
+	uint32_t tags[4];
+	size_t ntags = 0;
+
+	if (include_density) {
+		tags[ntags++] = 0;
+		tags[ntags++] = buffers.tag(density);
+	}
+	if (include_count) {
+		tags[ntags++] = include_density ? 1 : 0;
+		tags[ntags++] = buffers.tag(count);
+	}
+
+	if (points) {
+		// All the points are a single moveto
+		geometry[0] = (((geometry.size() - 1) / 2) << 3) | mvt_moveto;
+	}
+
+	buffers.feature.clear();
+	protozero::pbf_writer feature_writer(buffers.feature);
+	feature_writer.add_enum(3, points ? mvt_point : mvt_polygon);
+	feature_writer.add_packed_uint32(2, tags, tags + ntags);
+	feature_writer.add_packed_uint32(4, geometry.begin(), geometry.end());
+
+	protozero::pbf_writer features_writer(buffers.features);
+	features_writer.add_message(2, buffers.feature);
+}
+
+// Encode the grid of normalized densities in buffers.normalized as a
+// vector tile in buffers.pbf, writing the protobuf directly instead of
+// going through mvt_tile, since the features are always unit squares.
+// Returns the number of features in the tile.
+static size_t encode_grid(tile &tile, int z, int detail, density_table const &densities, std::string const &layername, std::map<std::string, layermap_entry> *layermap, tile_buffers &buffers) {
+	std::vector<long long> &normalized = buffers.normalized;
+	size_t features = 0;
+
+	buffers.features.clear();
+	buffers.values.clear();
+	buffers.value_index.clear();
+	buffers.geometries.resize(levels);
+	buffers.cursors.resize(levels);
+
+	auto fk = layermap->find(layername);
+
+	if (single_polygons) {
+		std::vector<uint32_t> &geometry = buffers.geometries[0];
+
+		for (size_t y = 0; y < (1U << detail); y++) {
+			for (size_t x = 0; x < (1U << detail); x++) {
+				if (tile.count[y * (1 << detail) + x] != 0) {
+					long long px = 0, py = 0;
+
+					geometry.clear();
+					if (points) {
+						geometry.push_back(0);
+					}
+					add_bin(geometry, x, y, px, py);
+					add_feature(buffers, geometry, normalized[y * (1 << detail) + x], tile.count[y * (1 << detail) + x]);
+					features++;
+
+					if (include_density) {
+						type_and_string attrib;
+						attrib.type = mvt_double;
+						attrib.string = std::to_string((unsigned long long) normalized[y * (1 << detail) + x]);
+						add_to_file_keys(fk->second.file_keys, "density", attrib);
+					}
+
+					if (include_count) {
+						type_and_string attrib;
+						attrib.type = mvt_double;
+						attrib.string = std::to_string((unsigned long long) tile.count[y * (1 << detail) + x]);
+						add_to_file_keys(fk->second.file_keys, "count", attrib);
+					}
+
+					if (points) {
+						fk->second.points++;
+					} else {
+						fk->second.polygons++;
+					}
+					if (z < fk->second.minzoom) {
+						fk->second.minzoom = z;
+					}
+					if (z > fk->second.maxzoom) {
+						fk->second.maxzoom = z;
+					}
+				}
+			}
+		}
+	} else {
+		for (size_t i = 0; i < buffers.geometries.size(); i++) {
+			buffers.geometries[i].clear();
+		}
+
+		for (size_t y = 0; y < (1U << detail); y++) {
+			for (size_t x = 0; x < (1U << detail); x++) {
+				long long density = normalized[y * (1 << detail) + x];
+				if (density != 0) {
+					std::vector<uint32_t> &geometry = buffers.geometries[density];
+					std::pair<long long, long long> &cursor = buffers.cursors[density];
+
+					if (geometry.size() == 0) {
+						cursor.first = cursor.second = 0;
+						if (points) {
+							geometry.push_back(0);
+						}
+					}
+					add_bin(geometry, x, y, cursor.first, cursor.second);
+
+					if (points) {
+						fk->second.points++;
+					} else {
+						fk->second.polygons++;
+					}
+					if (z < fk->second.minzoom) {
+						fk->second.minzoom = z;
+					}
+					if (z > fk->second.maxzoom) {
+						fk->second.maxzoom = z;
+					}
+				}
+			}
+		}
+
+		for (size_t i = first_level; i < buffers.geometries.size(); i++) {
+			if (buffers.geometries[i].size() != 0) {
+				long long count = densities.counts[i];
+				if (count < first_count) {
+					continue;
+				}
+
+				add_feature(buffers, buffers.geometries[i], i, count);
+				features++;
+
+				if (include_density) {
+					type_and_string attrib;
+					attrib.type = mvt_double;
+					attrib.string = std::to_string((unsigned long long) i);
+					add_to_file_keys(fk->second.file_keys, "density", attrib);
+				}
+
+				if (include_count) {
+					type_and_string attrib;
+					attrib.type = mvt_double;
+					attrib.string = std::to_string((unsigned long long) count);
+					add_to_file_keys(fk->second.file_keys, "count", attrib);
+				}
+			}
+		}
+	}
+
+	if (features == 0) {
+		return 0;
+	}
+
+	buffers.layer.clear();
+	protozero::pbf_writer layer_writer(buffers.layer);
+	layer_writer.add_uint32(15, 2);              /* version */
+	layer_writer.add_string(1, layername);       /* name */
+	layer_writer.add_uint32(5, 1U << detail);    /* extent */
+
+	if (include_density) {
+		layer_writer.add_string(3, "density"); /* key */
+	}
+	if (include_count) {
+		layer_writer.add_string(3, "count"); /* key */
+	}
+
+	for (size_t v = 0; v < buffers.values.size(); v++) {
+		buffers.value.clear();
+		protozero::pbf_writer value_writer(buffers.value);
+		value_writer.add_uint64(5, buffers.values[v]);
+		layer_writer.add_message(4, buffers.value);
+	}
+
+	buffers.layer.append(buffers.features);
+
+	buffers.pbf.clear();
+	protozero::pbf_writer writer(buffers.pbf);
+	writer.add_message(3, buffers.layer);
+
+	return features;
+}
+
+// Encode the grid of normalized densities in buffers.normalized as a
+// paletted PNG, in which each density level is one color.
+static void encode_png(int detail, tile_buffers &buffers, std::string &compressed) {
+	size_t dim = 1U << detail;
+
+	if (buffers.colors.size() == 0) {
+		buffers.colors.resize(levels);
+		buffers.transparency.resize(levels);
+
+		for (int i = 0; i < levels / 2; i++) {
+			buffers.colors[i].red = (color >> 16) & 0xFF;
+			buffers.colors[i].green = (color >> 8) & 0xFF;
+			buffers.colors[i].blue = (color >> 0) & 0xFF;
+			buffers.transparency[i] = 255 * i / (levels / 2);
+		}
+		for (int i = levels / 2; i < levels; i++) {
+			double along = 255 * (i - levels / 2) / (levels - levels / 2 - 1) / 255.0;
+			int fg = white ? 0x00 : 0xFF;
+
+			buffers.colors[i].red = ((color >> 16) & 0xFF) * (1 - along) + fg * (along);
+			buffers.colors[i].green = ((color >> 8) & 0xFF) * (1 - along) + fg * (along);
+			buffers.colors[i].blue = ((color >> 0) & 0xFF) * (1 - along) + fg * (along);
+			buffers.transparency[i] = 255;
+		}
+	}
+
+	if (buffers.rows.size() != dim) {
+		buffers.pixels.resize(dim * dim);
+		buffers.rows.resize(dim);
+		for (size_t y = 0; y < dim; y++) {
+			buffers.rows[y] = &buffers.pixels[y * dim];
+		}
+	}
+
+	for (size_t i = 0; i < dim * dim; i++) {
+		buffers.pixels[i] = buffers.normalized[i];
+	}
+
+	png_structp png_ptr;
+	png_infop info_ptr;
+
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, fail, fail);
+	if (png_ptr == NULL) {
+		fprintf(stderr, "PNG failure (write struct)\n");
+		exit(EXIT_FAILURE);
+	}
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		png_destroy_write_struct(&png_ptr, NULL);
+		fprintf(stderr, "PNG failure (info struct)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	png_set_IHDR(png_ptr, info_ptr, dim, dim, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_tRNS(png_ptr, info_ptr, buffers.transparency.data(), levels, NULL);
+	png_set_PLTE(png_ptr, info_ptr, buffers.colors.data(), levels);
+
+	if (compression_level >= 0) {
+		png_set_compression_level(png_ptr, compression_level);
+	}
+	if (png_filter >= 0) {
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, png_filter);
+	}
+
+	// Most tiles come out about the same size as the biggest one so far
+	compressed.reserve(buffers.png_size);
+
+	png_set_rows(png_ptr, info_ptr, buffers.rows.data());
+	png_set_write_fn(png_ptr, &compressed, string_append, NULL);
+	png_write_png(png_ptr, info_ptr, 0, NULL);
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_info_struct(png_ptr, &info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+
+	if (compressed.size() > buffers.png_size) {
+		buffers.png_size = compressed.size();
+	}
+}
+
+// Normalize, encode, and compress one tile, returning the empty string
+// if nothing in it survives the thresholds. Bins that are thresholded
+// away are zeroed in place in the tile's counts.
+std::string make_tile(tile &tile, int z, int detail, density_table const &densities, std::string const &layername, std::map<std::string, layermap_entry> *layermap, tile_buffers &buffers) {
 	long long thresh = first_count;
 	bool again = true;
-	tile tile = otile;
+
+	// For -K: the counts of the bins that are still in the tile, and the
+	// number of bins and bytes that each attempt at encoding it produced
+	std::vector<std::pair<long long, size_t>> histogram;
+	std::vector<std::pair<size_t, size_t>> attempts;
 
 	std::string compressed;
 
 	while (again) {
 		again = false;
 
+		// Raising the threshold only ever removes more bins, and doesn't
+		// change the density of the ones that remain, so each attempt
+		// can start from what the previous one left behind.
 		compressed = "";
-		tile = otile;
 
-		std::vector<long long> normalized;
+		std::vector<long long> &normalized = buffers.normalized;
 		normalized.resize(tile.count.size());
+		bool anything = false;
 
 		for (size_t y = 0; y < (1U << detail); y++) {
 			for (size_t x = 0; x < (1U << detail); x++) {
@@ -142,355 +684,597 @@ void make_tile(sqlite3 *outdb, tile &otile, int z, int detail, long long zoom_ma
 					tile.count[y * (1 << detail) + x] = 0;
 				}
 
-				if (count > 0) {
-					density = exp(log(exp(log(levels) * count_gamma) * count / zoom_max) / count_gamma);
+				if (count > 0) {
+					long long level = densities.level(count);
+
+					if (level < first_level) {
+						count = 0;
+						tile.count[y * (1 << detail) + x] = 0;
+					} else {
+						density = densities.density(level);
+						if (density > 0) {
+							anything = true;
+						}
+					}
+				}
+
+				normalized[y * (1 << detail) + x] = density;
+			}
+		}
+
+		if (bitmap) {
+			if (!anything) {
+				return "";
+			}
+
+			double before = report_timing ? pipeline_now() : 0;
+			encode_png(detail, buffers, compressed);
+			if (report_timing) {
+				buffers.compressing += pipeline_now() - before;
+				buffers.compressed++;
+			}
+		} else {
+			if (encode_grid(tile, z, detail, densities, layername, layermap, buffers) > 0) {
+				double before = report_timing ? pipeline_now() : 0;
+				if (buffers.zlib.compress(buffers.pbf, compressed) != 0) {
+					fprintf(stderr, "Compression of tile %d/%lld/%lld failed\n", z, tile.x, tile.y);
+					exit(EXIT_FAILURE);
+				}
+				if (report_timing) {
+					buffers.compressing += pipeline_now() - before;
+					buffers.compressed++;
+				}
+			}
+		}
+
+		if (compressed.size() == 0) {
+			return "";
+		}
+
+		if (compressed.size() > MAX_TILE_SIZE && increment_threshold) {
+			if (histogram.size() == 0) {
+				std::vector<long long> vals;
+				for (size_t i = 0; i < tile.count.size(); i++) {
+					if (tile.count[i] > 0) {
+						vals.push_back(tile.count[i]);
+					}
+				}
+				std::sort(vals.begin(), vals.end());
+
+				for (size_t i = 0; i < vals.size(); i++) {
+					if (histogram.size() == 0 || histogram.back().first != vals[i]) {
+						histogram.push_back(std::pair<long long, size_t>(vals[i], 0));
+					}
+					histogram.back().second++;
+				}
+			} else {
+				size_t below = 0;
+				while (below < histogram.size() && histogram[below].first < thresh) {
+					below++;
+				}
+				histogram.erase(histogram.begin(), histogram.begin() + below);
+			}
+
+			size_t bins = 0;
+			for (size_t i = 0; i < histogram.size(); i++) {
+				bins += histogram[i].second;
+			}
+			attempts.push_back(std::pair<size_t, size_t>(bins, compressed.size()));
+
+			// Aim for 95% of the limit, assuming that the size is proportional
+			// to the number of bins. After two attempts, fit a line through
+			// them instead, to account for the fixed part of the size.
+			ssize_t n = ceil(bins - bins * MAX_TILE_SIZE / compressed.size() * 0.95);
+
+			if (attempts.size() >= 2) {
+				std::pair<size_t, size_t> a = attempts[attempts.size() - 2];
+				std::pair<size_t, size_t> b = attempts[attempts.size() - 1];
+
+				if (a.first > b.first && a.second > b.second) {
+					double per_bin = (a.second - b.second) / (double) (a.first - b.first);
+					double fixed = b.second - per_bin * b.first;
+					double keep = (MAX_TILE_SIZE * 0.95 - fixed) / per_bin;
+
+					if (keep >= 0) {
+						n = ceil(bins - keep);
+					}
+				}
+			}
+
+			if (n >= (ssize_t) bins) {
+				n = bins - 1;
+			}
+			if (n < 0) {
+				n = 0;
+			}
+
+			// The count of the nth smallest bin that remains
+			for (size_t i = 0; i < histogram.size(); i++) {
+				if ((size_t) n < histogram[i].second) {
+					thresh = histogram[i].first + 1;
+					break;
+				}
+				n -= histogram[i].second;
+			}
+
+			fprintf(stderr, "Raising threshold to %lld for %zu bytes in tile %d/%lld/%lld\n", thresh, compressed.size(), z, tile.x, tile.y);
+			again = true;
+			continue;
+		}
+
+		if (limit_tile_sizes && compressed.size() > MAX_TILE_SIZE) {
+			fprintf(stderr, "Tile is too big: %zu\n", compressed.size());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return compressed;
+}
+
+void *run_writer(void *v) {
+	tile_writer *w = (tile_writer *) v;
+	double start = pipeline_now();
+
+	output_start(*w->out, TILES_PER_TRANSACTION);
+
+	std::vector<encoded_tile> batch;
+	while (w->queue.pop(batch, WRITER_BATCH)) {
+		double before = pipeline_now();
+
+		for (size_t i = 0; i < batch.size(); i++) {
+			output_tile(*w->out, batch[i].z, batch[i].x, batch[i].y, batch[i].data.data(), batch[i].data.size());
+			w->bytes += batch[i].data.size();
+		}
+
+		w->tiles += batch.size();
+		w->batches++;
+		w->busy += pipeline_now() - before;
+	}
+
+	double before = pipeline_now();
+	output_finish(*w->out);
+	w->busy += pipeline_now() - before;
+	w->duplicates = w->out->mbtiles.duplicates;
+
+	w->elapsed = pipeline_now() - start;
+	return NULL;
+}
+
+void start_writer(tile_writer *w) {
+	if (pthread_create(&w->thread, NULL, run_writer, w) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void finish_writer(tile_writer *w) {
+	w->queue.close();
+
+	void *ret;
+	if (pthread_join(w->thread, &ret) != 0) {
+		perror("pthread_join");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Encoder threads take completed tile grids from the scanners
+// and hand the encoded tiles on to the writer.
+
+struct encoder {
+	bounded_queue<tile> *grids;
+	recycler<std::vector<long long>> *spares;
+	tile_writer *writer;
+	std::vector<density_table> const *densities;
+	size_t detail;
+	std::string layername;
+	std::map<std::string, layermap_entry> *layermap;
+	pthread_t thread;
+
+	size_t tiles = 0;
+	double busy = 0;
+	size_t compressed = 0;
+	double compressing = 0;
+};
+
+void *run_encoder(void *v) {
+	encoder *e = (encoder *) v;
+
+	std::vector<tile> batch;
+	tile_buffers buffers;
+	while (e->grids->pop(batch, 1)) {
+		for (size_t i = 0; i < batch.size(); i++) {
+			double before = pipeline_now();
+			std::string compressed = make_tile(batch[i], batch[i].z, e->detail, (*e->densities)[batch[i].z], e->layername, e->layermap, buffers);
+			e->busy += pipeline_now() - before;
+			e->tiles++;
+
+			e->writer->write(batch[i].z, batch[i].x, batch[i].y, std::move(compressed));
+			e->spares->put(std::move(batch[i].count));
+		}
+	}
+
+	e->compressed = buffers.compressed;
+	e->compressing = buffers.compressing;
+	return NULL;
+}
+
+void calc_tile_edges(size_t z, long long x, long long y, unsigned long long &start, unsigned long long &end) {
+	start = encode(x << (32 - z), y << (32 - z));
+	end = start;
+
+	for (size_t i = 0; i < 32 - z; i++) {
+		end |= 3ULL << (2 * i);
+	}
+}
+
+unsigned long long read_record_key(FILE *fp, size_t record) {
+	unsigned char buf[RECORD_BYTES];
+
+	if (fseeko(fp, record * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
+		perror("fseeko");
+		exit(EXIT_FAILURE);
+	}
+	if (fread(buf, RECORD_BYTES, 1, fp) != 1) {
+		perror("fread");
+		exit(EXIT_FAILURE);
+	}
+
+	return read64(buf);
+}
+
+// The first record from `lo` to `hi` whose quadkey is at least `key`
+size_t find_record_key(FILE *fp, size_t lo, size_t hi, unsigned long long key) {
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (read_record_key(fp, mid) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static size_t span_records(record_spans const &spans) {
+	size_t n = 0;
+	for (size_t i = 0; i < spans.size(); i++) {
+		n += spans[i].second - spans[i].first;
+	}
+	return n;
+}
+
+// The record that is `n` records into the spans
+static size_t span_record(record_spans const &spans, size_t n, size_t records) {
+	for (size_t i = 0; i < spans.size(); i++) {
+		if (n < spans[i].second - spans[i].first) {
+			return spans[i].first + n;
+		}
+		n -= spans[i].second - spans[i].first;
+	}
+	return records;
+}
+
+static FILE *open_count(const char *fname) {
+	FILE *fp = fopen(fname, "rb");
+	if (fp == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	char buf[HEADER_LEN];
+	if (fread(buf, HEADER_LEN, 1, fp) != 1 || memcmp(buf, header_text, HEADER_LEN) != 0) {
+		fprintf(stderr, "%s: not a tile-count file\n", fname);
+		exit(EXIT_FAILURE);
+	}
 
-					if (density < first_level) {
-						density = 0;
-						count = 0;
-						tile.count[y * (1 << detail) + x] = 0;
-					}
-				}
-				density *= brighten;
-				if (density > levels - 1) {
-					density = levels - 1;
-				}
+	return fp;
+}
 
-				normalized[y * (1 << detail) + x] = density;
-			}
-		}
+static bool next_record(FILE *fp, unsigned long long &key, unsigned long long &count) {
+	unsigned char buf[RECORD_BYTES];
+	if (fread(buf, RECORD_BYTES, 1, fp) != 1) {
+		return false;
+	}
 
-		if (bitmap) {
-			bool anything = false;
-			for (size_t y = 0; y < 1U << detail; y++) {
-				for (size_t x = 0; x < (1U << detail); x++) {
-					long long density = normalized[y * (1 << detail) + x];
-					if (density > 0) {
-						anything = true;
-					}
-				}
-			}
-			if (!anything) {
-				return;
-			}
+	key = read64(buf);
+	count = read32(buf + INDEX_BYTES);
+	return true;
+}
 
-			unsigned char *rows[1U << detail];
-			for (size_t y = 0; y < 1U << detail; y++) {
-				rows[y] = new unsigned char[1U << detail];
+// The maxzoom tiles with records in `fname`, or if `previous` is given,
+// the ones with records that are different between `previous` and `fname`.
+// Both files are sorted, so they can be compared in a single pass.
+std::vector<unsigned long long> find_changed_tiles(const char *fname, const char *previous, size_t maxzoom) {
+	unsigned long long mask = 0;
+	if (maxzoom > 0) {
+		mask = ~((1ULL << (2 * (32 - maxzoom))) - 1);
+	}
 
-				for (size_t x = 0; x < (1U << detail); x++) {
-					long long density = normalized[y * (1 << detail) + x];
-					rows[y][x] = density;
-				}
-			}
+	std::vector<unsigned long long> out;
+	auto add = [&](unsigned long long key) {
+		key &= mask;
+		if (out.size() == 0 || out.back() != key) {
+			out.push_back(key);
+		}
+	};
 
-			png_structp png_ptr;
-			png_infop info_ptr;
+	FILE *a = open_count(fname);
+	unsigned long long akey = 0, acount = 0;
+	bool ahave = next_record(a, akey, acount);
 
-			png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, fail, fail);
-			if (png_ptr == NULL) {
-				fprintf(stderr, "PNG failure (write struct)\n");
-				exit(EXIT_FAILURE);
-			}
-			info_ptr = png_create_info_struct(png_ptr);
-			if (info_ptr == NULL) {
-				png_destroy_write_struct(&png_ptr, NULL);
-				fprintf(stderr, "PNG failure (info struct)\n");
-				exit(EXIT_FAILURE);
+	if (previous == NULL) {
+		for (; ahave; ahave = next_record(a, akey, acount)) {
+			add(akey);
+		}
+	} else {
+		FILE *b = open_count(previous);
+		unsigned long long bkey = 0, bcount = 0;
+		bool bhave = next_record(b, bkey, bcount);
+
+		while (ahave || bhave) {
+			if (bhave && (!ahave || bkey < akey)) {
+				add(bkey);
+				bhave = next_record(b, bkey, bcount);
+			} else if (ahave && (!bhave || akey < bkey)) {
+				add(akey);
+				ahave = next_record(a, akey, acount);
 			} else {
-				png_set_IHDR(png_ptr, info_ptr, 1U << detail, 1U << detail, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-				png_byte transparency[levels];
-				png_color colors[levels];
-				for (int i = 0; i < levels / 2; i++) {
-					colors[i].red = (color >> 16) & 0xFF;
-					colors[i].green = (color >> 8) & 0xFF;
-					colors[i].blue = (color >> 0) & 0xFF;
-					transparency[i] = 255 * i / (levels / 2);
+				if (acount != bcount) {
+					add(akey);
 				}
-				for (int i = levels / 2; i < levels; i++) {
-					double along = 255 * (i - levels / 2) / (levels - levels / 2 - 1) / 255.0;
-					int fg = white ? 0x00 : 0xFF;
-
-					colors[i].red = ((color >> 16) & 0xFF) * (1 - along) + fg * (along);
-					colors[i].green = ((color >> 8) & 0xFF) * (1 - along) + fg * (along);
-					colors[i].blue = ((color >> 0) & 0xFF) * (1 - along) + fg * (along);
-					transparency[i] = 255;
-				}
-				png_set_tRNS(png_ptr, info_ptr, transparency, levels, NULL);
-				png_set_PLTE(png_ptr, info_ptr, colors, levels);
-
-				png_set_rows(png_ptr, info_ptr, rows);
-				png_set_write_fn(png_ptr, &compressed, string_append, NULL);
-				png_write_png(png_ptr, info_ptr, 0, NULL);
-				png_write_end(png_ptr, info_ptr);
-				png_destroy_info_struct(png_ptr, &info_ptr);
-				png_destroy_write_struct(&png_ptr, &info_ptr);
-			}
-
-			for (size_t i = 0; i < 1U << detail; i++) {
-				delete[] rows[i];
+				ahave = next_record(a, akey, acount);
+				bhave = next_record(b, bkey, bcount);
 			}
-		} else {
-			mvt_layer layer;
-			layer.name = layername;
-			layer.version = 2;
-			layer.extent = 1U << detail;
-
-			std::vector<mvt_feature> features;
-			features.resize(levels);
-
-			if (single_polygons) {
-				for (size_t y = 0; y < (1U << detail); y++) {
-					for (size_t x = 0; x < (1U << detail); x++) {
-						if (tile.count[y * (1 << detail) + x] != 0) {
-							mvt_feature feature;
-							if (points) {
-								feature.type = mvt_point;
-							} else {
-								feature.type = mvt_polygon;
-							}
+		}
 
-							feature.geometry.push_back(mvt_geometry(mvt_moveto, x, y));
+		fclose(b);
+	}
 
-							if (!points) {
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 1), (y + 0)));
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 1), (y + 1)));
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 0), (y + 1)));
-								feature.geometry.push_back(mvt_geometry(mvt_closepath, 0, 0));
-							}
+	fclose(a);
+	return out;
+}
 
-							if (include_density) {
-								mvt_value val;
-								val.type = mvt_uint;
-								val.numeric_value.uint_value = normalized[y * (1 << detail) + x];
-								layer.tag(feature, "density", val);
+// Whether the tile is one that an incremental re-tiling has to make again
+bool tile_changed(int z, long long x, long long y) {
+	if (!incremental || whole_zoom[z]) {
+		return true;
+	}
 
-								type_and_string attrib;
-								attrib.type = mvt_double;
-								attrib.string = std::to_string(val.numeric_value.uint_value);
+	unsigned long long first_for_tile, last_for_tile;
+	calc_tile_edges(z, x, y, first_for_tile, last_for_tile);
 
-								auto fk = layermap->find(layername);
-								add_to_file_keys(fk->second.file_keys, "density", attrib);
-							}
+	auto f = std::lower_bound(changed_tiles.begin(), changed_tiles.end(), first_for_tile);
+	return f != changed_tiles.end() && *f <= last_for_tile;
+}
 
-							if (include_count) {
-								mvt_value val;
-								val.type = mvt_uint;
-								val.numeric_value.uint_value = tile.count[y * (1 << detail) + x];
-								layer.tag(feature, "count", val);
+// The records, in order, whose quadkeys fall within the key ranges
+record_spans find_key_spans(FILE *fp, size_t records, std::vector<std::pair<unsigned long long, unsigned long long>> const &key_ranges) {
+	record_spans spans;
+	size_t lo = 0;
 
-								type_and_string attrib;
-								attrib.type = mvt_double;
-								attrib.string = std::to_string(val.numeric_value.uint_value);
+	for (size_t j = 0; j < key_ranges.size(); j++) {
+		size_t first = find_record_key(fp, lo, records, key_ranges[j].first);
+		size_t last = records;
+		if (key_ranges[j].second != ULLONG_MAX) {
+			last = find_record_key(fp, first, records, key_ranges[j].second + 1);
+		}
 
-								auto fk = layermap->find(layername);
-								add_to_file_keys(fk->second.file_keys, "count", attrib);
-							}
+		if (first < last) {
+			spans.push_back(std::pair<size_t, size_t>(first, last));
+		}
+		lo = last;
+	}
 
-							auto fk = layermap->find(layername);
-							if (points) {
-								fk->second.points++;
-							} else {
-								fk->second.polygons++;
-							}
-							if (z < fk->second.minzoom) {
-								fk->second.minzoom = z;
-							}
-							if (z > fk->second.maxzoom) {
-								fk->second.maxzoom = z;
-							}
+	return spans;
+}
 
-							layer.features.push_back(feature);
-						}
-					}
-				}
-			} else {
-				for (size_t y = 0; y < (1U << detail); y++) {
-					for (size_t x = 0; x < (1U << detail); x++) {
-						long long density = normalized[y * (1 << detail) + x];
-						if (density != 0) {
-							mvt_feature &feature = features[density];
-							if (points) {
-								feature.type = mvt_point;
-							} else {
-								feature.type = mvt_polygon;
-							}
+// The ranges of quadkeys of the tiles at zoom `z` that contain changed tiles
+std::vector<std::pair<unsigned long long, unsigned long long>> changed_key_ranges(size_t z) {
+	std::vector<std::pair<unsigned long long, unsigned long long>> out;
 
-							feature.geometry.push_back(mvt_geometry(mvt_moveto, x, y));
+	for (size_t i = 0; i < changed_tiles.size(); i++) {
+		unsigned x, y;
+		decode(changed_tiles[i], &x, &y);
 
-							if (!points) {
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 1), (y + 0)));
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 1), (y + 1)));
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 0), (y + 1)));
-								feature.geometry.push_back(mvt_geometry(mvt_closepath, 0, 0));
-							}
+		unsigned long long first_for_tile, last_for_tile;
+		calc_tile_edges(z, z == 0 ? 0 : x >> (32 - z), z == 0 ? 0 : y >> (32 - z), first_for_tile, last_for_tile);
 
-							auto fk = layermap->find(layername);
-							if (points) {
-								fk->second.points++;
-							} else {
-								fk->second.polygons++;
-							}
-							if (z < fk->second.minzoom) {
-								fk->second.minzoom = z;
-							}
-							if (z > fk->second.maxzoom) {
-								fk->second.maxzoom = z;
-							}
-						}
-					}
-				}
+		if (out.size() > 0 && (out.back().second == ULLONG_MAX || out.back().second + 1 >= first_for_tile)) {
+			out.back().second = std::max(out.back().second, last_for_tile);
+		} else {
+			out.push_back(std::pair<unsigned long long, unsigned long long>(first_for_tile, last_for_tile));
+		}
+	}
 
-				for (size_t i = first_level; i < features.size(); i++) {
-					if (features[i].geometry.size() != 0) {
-						// features[i].geometry = merge_rings(features[i].geometry);
+	return out;
+}
 
-						long long count = ceil(exp(log(i) * count_gamma) * zoom_max / exp(log(levels) * count_gamma));
-						if (count < first_count) {
-							continue;
-						}
+// Split the records in `spans` evenly between the shards, and then move
+// each shard's start to whichever edge of its tile at zoom `z` is closer,
+// so that no tile at that zoom or deeper is split between two shards.
+// Only the ancestors of the boundary tiles are left partial.
+void align_shards(std::vector<tiler> &tilers, FILE *fp, size_t records, record_spans const &spans, size_t z) {
+	size_t cpus = tilers.size();
+	size_t todo = span_records(spans);
 
-						if (include_density) {
-							mvt_value val;
-							val.type = mvt_uint;
-							val.numeric_value.uint_value = i;
-							layer.tag(features[i], "density", val);
+	tilers[0].start = 0;
+	tilers[0].shard_first = 0;
 
-							type_and_string attrib;
-							attrib.type = mvt_double;
-							attrib.string = std::to_string(val.numeric_value.uint_value);
+	for (size_t j = 1; j < cpus; j++) {
+		size_t start = span_record(spans, j * todo / cpus, records);
 
-							auto fk = layermap->find(layername);
-							add_to_file_keys(fk->second.file_keys, "density", attrib);
-						}
+		if (start < tilers[j - 1].start) {
+			start = tilers[j - 1].start;
+		}
 
-						if (include_count) {
-							mvt_value val;
-							val.type = mvt_uint;
-							val.numeric_value.uint_value = count;
-							layer.tag(features[i], "count", val);
+		if (start >= records || start == 0) {
+			tilers[j].start = start;
+			tilers[j].shard_first = tilers[j - 1].shard_first;
+		} else {
+			unsigned long long key = read_record_key(fp, start);
+			unsigned x, y;
+			decode(key, &x, &y);
 
-							type_and_string attrib;
-							attrib.type = mvt_double;
-							attrib.string = std::to_string(val.numeric_value.uint_value);
+			unsigned long long first_for_tile, last_for_tile;
+			calc_tile_edges(z, z == 0 ? 0 : x >> (32 - z), z == 0 ? 0 : y >> (32 - z), first_for_tile, last_for_tile);
 
-							auto fk = layermap->find(layername);
-							add_to_file_keys(fk->second.file_keys, "count", attrib);
-						}
+			size_t before = find_record_key(fp, tilers[j - 1].start, start, first_for_tile);
+			size_t after = records;
+			if (last_for_tile != ULLONG_MAX) {
+				after = find_record_key(fp, start, records, last_for_tile + 1);
+			}
 
-						layer.features.push_back(features[i]);
-					}
-				}
+			// The previous shard must keep at least the tile it starts with
+			if (before > tilers[j - 1].start && (start - before <= after - start || after >= records)) {
+				tilers[j].start = before;
+				tilers[j].shard_first = first_for_tile;
+			} else if (after < records) {
+				tilers[j].start = after;
+				tilers[j].shard_first = last_for_tile + 1;
+			} else {
+				tilers[j].start = records;
+				tilers[j].shard_first = ULLONG_MAX;
 			}
+		}
 
-			if (layer.features.size() > 0) {
-				mvt_tile mvt;
-				mvt.layers.push_back(layer);
+		tilers[j - 1].end = tilers[j].start;
+	}
+	tilers[cpus - 1].end = records;
 
-				std::string pbf = mvt.encode();
-				compress(pbf, compressed);
+	// A shard with no records claims no quadkeys, and the one before it
+	// reaches as far as the next shard that does have some
+	for (size_t j = 0; j < cpus; j++) {
+		tilers[j].shard_last = ULLONG_MAX;
+
+		for (size_t k = j + 1; k < cpus; k++) {
+			if (tilers[k].start < tilers[k].end) {
+				tilers[j].shard_last = tilers[k].shard_first - 1;
+				break;
 			}
 		}
 
-		if (compressed.size() == 0) {
-			return;
-		}
+		tilers[j].spans.clear();
+		for (size_t i = 0; i < spans.size(); i++) {
+			size_t first = std::max(spans[i].first, tilers[j].start);
+			size_t last = std::min(spans[i].second, tilers[j].end);
 
-		if (compressed.size() > MAX_TILE_SIZE && increment_threshold) {
-			std::vector<long long> vals;
-			for (size_t i = 0; i < tile.count.size(); i++) {
-				if (tile.count[i] > 0) {
-					vals.push_back(tile.count[i]);
-				}
-			}
-			std::sort(vals.begin(), vals.end());
-			ssize_t n = ceil(vals.size() - vals.size() * MAX_TILE_SIZE / compressed.size() * 0.95);
-			if (n >= (ssize_t) vals.size()) {
-				n = vals.size() - 1;
-			}
-			if (n < 0) {
-				n = 0;
+			if (first < last) {
+				tilers[j].spans.push_back(std::pair<size_t, size_t>(first, last));
 			}
-			thresh = vals[n] + 1;
+		}
+	}
+}
 
-			fprintf(stderr, "Raising threshold to %lld for %zu bytes in tile %d/%lld/%lld\n", thresh, compressed.size(), z, tile.x, tile.y);
-			again = true;
-			continue;
+// The coarsest zoom whose tile boundaries still let the shards come out
+// within a quarter of an even split of the records, so that as few
+// tiles as possible have to be merged from more than one shard
+size_t choose_shard_zoom(std::vector<tiler> &tilers, FILE *fp, size_t records, record_spans const &spans, size_t minzoom, size_t maxzoom) {
+	size_t even = (span_records(spans) + tilers.size() - 1) / tilers.size();
+
+	for (size_t z = minzoom; z < maxzoom; z++) {
+		align_shards(tilers, fp, records, spans, z);
+
+		size_t largest = 0;
+		for (size_t j = 0; j < tilers.size(); j++) {
+			largest = std::max(largest, span_records(tilers[j].spans));
 		}
 
-		if (limit_tile_sizes && compressed.size() > MAX_TILE_SIZE) {
-			fprintf(stderr, "Tile is too big: %zu\n", compressed.size());
-			exit(EXIT_FAILURE);
+		if (largest <= even + even / 4) {
+			return z;
 		}
 	}
 
-	static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+	align_shards(tilers, fp, records, spans, maxzoom);
+	return maxzoom;
+}
 
-	if (pthread_mutex_lock(&db_lock) != 0) {
-		perror("pthread_mutex_lock");
-		exit(EXIT_FAILURE);
-	}
+// Tiles that straddle shard boundaries, all from one zoom level,
+// to be summed and then handled like any complete tile
+struct partial_merger {
+	std::vector<tile> tiles;
+	long long max = 0;
+};
 
-	mbtiles_write_tile(outdb, z, tile.x, tile.y, compressed.data(), compressed.size());
+struct partial_mergers {
+	std::vector<partial_merger> *zooms;
+	size_t pass;
+	int detail;
+	bounded_queue<tile> *grids;
+};
 
-	if (pthread_mutex_unlock(&db_lock) != 0) {
-		perror("pthread_mutex_unlock");
-		exit(EXIT_FAILURE);
-	}
+static unsigned long long partial_key(tile const &t) {
+	return ((unsigned long long) t.x << 32) | (unsigned long long) t.y;
 }
 
-void calc_tile_edges(size_t z, long long x, long long y, unsigned long long &start, unsigned long long &end) {
-	start = encode(x << (32 - z), y << (32 - z));
-	end = start;
+// Each zoom level's partial tiles are merged as one of the tasks of the thread pool
+void run_partials(void *p, size_t z) {
+	partial_mergers *pm = (partial_mergers *) p;
+	size_t cells = (1U << pm->detail) * (1U << pm->detail);
+
+	partial_merger &m = (*pm->zooms)[z];
+	std::sort(m.tiles.begin(), m.tiles.end(), [](tile const &a, tile const &b) {
+		return partial_key(a) < partial_key(b);
+	});
+
+	for (size_t i = 0; i < m.tiles.size();) {
+		size_t j = i + 1;
+		for (; j < m.tiles.size() && partial_key(m.tiles[j]) == partial_key(m.tiles[i]); j++) {
+			for (size_t x = 0; x < cells; x++) {
+				m.tiles[i].count[x] += m.tiles[j].count[x];
+			}
+		}
 
-	for (size_t i = 0; i < 32 - z; i++) {
-		end |= 3ULL << (2 * i);
+		if (pm->pass == 0) {
+			gather_quantile(m.tiles[i], pm->detail, m.max);
+		} else {
+			pm->grids->push(std::move(m.tiles[i]));
+		}
+
+		i = j;
 	}
 }
 
 void *run_tile(void *p) {
 	tiler *t = (tiler *) p;
+	double start_time = pipeline_now();
 
-	if (t->start >= t->end) {
-		return NULL;
-	}
-
-	unsigned char firstbuf[RECORD_BYTES];
-	unsigned char lastbuf[RECORD_BYTES];
-
-	if (fseeko(t->fp, t->start * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
-		perror("fseeko");
-		exit(EXIT_FAILURE);
-	}
-	if (fread(firstbuf, RECORD_BYTES, 1, t->fp) != 1) {
-		perror("fread");
-		exit(EXIT_FAILURE);
+	size_t todo = 0;
+	for (size_t s = 0; s < t->spans.size(); s++) {
+		todo += t->spans[s].second - t->spans[s].first;
 	}
 
-	if (fseeko(t->fp, (t->end - 1) * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
-		perror("fseeko");
-		exit(EXIT_FAILURE);
-	}
-	if (fread(lastbuf, RECORD_BYTES, 1, t->fp) != 1) {
-		perror("fread");
-		exit(EXIT_FAILURE);
+	if (todo == 0) {
+		t->elapsed = 0;
+		return NULL;
 	}
 
-	unsigned long long first = read64(firstbuf);
-	unsigned long long last = read64(lastbuf);
+	unsigned long long first = t->shard_first;
+	unsigned long long last = t->shard_last;
 
 	long long seq = 0;
 	long long percent = -1;
 	long long max = 0;
 
-	if (fseeko(t->fp, t->start * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
+	size_t span = 0;
+	if (fseeko(t->fp, t->spans[span].first * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
 		perror("fseeko");
 		exit(EXIT_FAILURE);
 	}
 
 	unsigned long long oindex = 0;
-	for (size_t i = t->start; i < t->end; i++) {
+	for (size_t i = t->spans[span].first; seq < (long long) todo; i++) {
+		if (i == t->spans[span].second) {
+			span++;
+			i = t->spans[span].first;
+
+			if (fseeko(t->fp, i * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
+				perror("fseeko");
+				exit(EXIT_FAILURE);
+			}
+		}
+
 		unsigned char buf[RECORD_BYTES];
 		if (fread(buf, RECORD_BYTES, 1, t->fp) != 1) {
 			perror("fread");
@@ -505,7 +1289,7 @@ void *run_tile(void *p) {
 		}
 		oindex = index;
 
-		long long npercent = 100 * seq / (t->end - t->start);
+		long long npercent = 100 * seq / todo;
 		if (npercent != percent) {
 			percent = npercent;
 			t->progress[t->shard] = percent;
@@ -560,7 +1344,11 @@ void *run_tile(void *p) {
 			}
 
 			if (t->tiles[z].x != tx || t->tiles[z].y != ty) {
-				if (t->tiles[z].active) {
+				// Tiles outside the --bbox or --tiles region were only
+				// read because they share records with ones inside it.
+				// Unchanged tiles still count toward the normalization.
+				if (t->tiles[z].active && region_intersects(tile_region, z, t->tiles[z].x, t->tiles[z].y) &&
+				    (t->pass == 0 || tile_changed(z, t->tiles[z].x, t->tiles[z].y))) {
 					unsigned long long first_for_tile, last_for_tile;
 					calc_tile_edges(z, t->tiles[z].x, t->tiles[z].y, first_for_tile, last_for_tile);
 
@@ -570,20 +1358,22 @@ void *run_tile(void *p) {
 						if (t->pass == 0) {
 							gather_quantile(t->tiles[z], t->detail, t->max[z]);
 						} else {
-							make_tile(t->outdb, t->tiles[z], z, t->detail, t->zoom_max[z], t->layername, t->layermap);
+							t->grids->push(std::move(t->tiles[z]));
+							t->spares->get(t->tiles[z].count);
 						}
 					} else {
-						t->partial_tiles.push_back(t->tiles[z]);
+						t->partial_tiles.push_back(std::move(t->tiles[z]));
 					}
 				}
 
 				t->tiles[z].active = true;
+				t->tiles[z].z = z;
 				t->tiles[z].x = tx;
 				t->tiles[z].y = ty;
 
-				for (size_t x = 0; x < (1U << t->detail) * (1U << t->detail); x++) {
-					t->tiles[z].count[x] = 0;
-				}
+				// Allocates a new grid if the old one was handed off
+				// and there was no spare to take its place
+				t->tiles[z].count.assign((1U << t->detail) * (1U << t->detail), 0);
 			}
 
 			t->tiles[z].count[py * (1 << t->detail) + px] += count;
@@ -598,7 +1388,8 @@ void *run_tile(void *p) {
 	}
 
 	for (size_t z = t->minzoom; z < t->zooms; z++) {
-		if (t->tiles[z].active) {
+		if (t->tiles[z].active && region_intersects(tile_region, z, t->tiles[z].x, t->tiles[z].y) &&
+		    (t->pass == 0 || tile_changed(z, t->tiles[z].x, t->tiles[z].y))) {
 			unsigned long long first_for_tile, last_for_tile;
 			calc_tile_edges(z, t->tiles[z].x, t->tiles[z].y, first_for_tile, last_for_tile);
 
@@ -608,17 +1399,56 @@ void *run_tile(void *p) {
 				if (t->pass == 0) {
 					gather_quantile(t->tiles[z], t->detail, t->max[z]);
 				} else {
-					make_tile(t->outdb, t->tiles[z], z, t->detail, t->zoom_max[z], t->layername, t->layermap);
+					t->grids->push(std::move(t->tiles[z]));
 				}
 			} else {
-				t->partial_tiles.push_back(t->tiles[z]);
+				t->partial_tiles.push_back(std::move(t->tiles[z]));
 			}
 		}
 	}
 
+	t->elapsed = pipeline_now() - start_time;
 	return NULL;
 }
 
+void report_scan(std::vector<tiler> const &tilers, bounded_queue<tile> &grids, std::vector<encoder> const &encoders) {
+	double scan = 0;
+	for (size_t j = 0; j < tilers.size(); j++) {
+		scan += tilers[j].elapsed;
+	}
+
+	double encode = 0;
+	size_t tiles = 0;
+	double compressing = 0;
+	size_t compressed = 0;
+	for (size_t j = 0; j < encoders.size(); j++) {
+		encode += encoders[j].busy;
+		tiles += encoders[j].tiles;
+		compressing += encoders[j].compressing;
+		compressed += encoders[j].compressed;
+	}
+
+	fprintf(stderr, "scan: %zu threads, %.3fs total, %.3fs waiting for encoders\n", tilers.size(), scan, grids.push_wait);
+	fprintf(stderr, "encode: %zu threads, %zu tiles, %.3fs encoding, %.3fs waiting for tiles\n", encoders.size(), tiles, encode, grids.pop_wait);
+	if (compressing > 0) {
+		fprintf(stderr, "compress: %zu tiles, %.3fs, %.0f tiles/sec per thread\n", compressed, compressing, compressed / compressing);
+	}
+	fprintf(stderr, "tile queue: %zu slots, max depth %zu, average depth %.1f\n", grids.limit, grids.max_depth, grids.average_depth());
+}
+
+void report_writer(tile_writer &writer) {
+	double rate = 0;
+	if (writer.busy > 0) {
+		rate = writer.tiles / writer.busy;
+	}
+
+	fprintf(stderr, "write: %zu tiles, %zu bytes in %zu batches, %.3fs writing (%.0f tiles/sec), %.3fs waiting for tiles, %.3fs elapsed\n", writer.tiles, writer.bytes, writer.batches, writer.busy, rate, writer.queue.pop_wait, writer.elapsed);
+	if (deduplicate) {
+		fprintf(stderr, "write: %zu tiles were duplicates of earlier tiles\n", writer.duplicates);
+	}
+	fprintf(stderr, "write queue: %zu slots, max depth %zu, average depth %.1f, %.3fs waiting for writer\n", writer.queue.limit, writer.queue.max_depth, writer.queue.average_depth(), writer.queue.push_wait());
+}
+
 void regress(std::vector<long long> &max, size_t minzoom) {
 	for (size_t i = minzoom; i < max.size(); i++) {
 		if (max[i] == 0) {
@@ -657,44 +1487,292 @@ void regress(std::vector<long long> &max, size_t minzoom) {
 	}
 }
 
-void write_meta(std::vector<long long> const &zoom_max, sqlite3 *outdb) {
-	char *sql, *err;
-
+std::string format_max_density(std::vector<long long> const &zoom_max) {
 	std::string maxes;
 	for (size_t i = 0; i < zoom_max.size(); i++) {
 		maxes.append(std::to_string(zoom_max[i]));
 		maxes.append(",");
 	}
+	return maxes;
+}
+
+void write_meta(std::vector<long long> const &zoom_max, sqlite3 *outdb) {
+	char *sql, *err;
+
+	std::string maxes = format_max_density(zoom_max);
+
+	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('max_density', %Q);", maxes.c_str());
+	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "set name in metadata: %s\n", err);
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_free(sql);
+
+	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('density_levels', %d);", levels);
+	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "set name in metadata: %s\n", err);
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_free(sql);
+
+	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('density_gamma', %f);", count_gamma);
+	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "set name in metadata: %s\n", err);
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_free(sql);
+}
+
+// Deletes the tiles from minzoom to maxzoom that touch the region
+void clear_region(sqlite3 *db, region const &r, int minzoom, int maxzoom) {
+	const char *query = "DELETE FROM tiles WHERE zoom_level = ? AND tile_column BETWEEN ? AND ? AND tile_row BETWEEN ? AND ?;";
+	if (mbtiles_has_map(db)) {
+		query = "DELETE FROM map WHERE zoom_level = ? AND tile_column BETWEEN ? AND ? AND tile_row BETWEEN ? AND ?;";
+	}
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 delete prep failed: %s\n", sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+
+	for (int z = minzoom; z <= maxzoom; z++) {
+		for (size_t i = 0; i < r.rects.size(); i++) {
+			long long top = (1LL << z) - 1;
+
+			sqlite3_bind_int(stmt, 1, z);
+			sqlite3_bind_int64(stmt, 2, r.rects[i].x1 >> (32 - z));
+			sqlite3_bind_int64(stmt, 3, r.rects[i].x2 >> (32 - z));
+			sqlite3_bind_int64(stmt, 4, top - (long long) (r.rects[i].y2 >> (32 - z)));
+			sqlite3_bind_int64(stmt, 5, top - (long long) (r.rects[i].y1 >> (32 - z)));
+
+			if (sqlite3_step(stmt) != SQLITE_DONE) {
+				fprintf(stderr, "sqlite3 delete failed: %s\n", sqlite3_errmsg(db));
+				exit(EXIT_FAILURE);
+			}
+			if (sqlite3_reset(stmt) != SQLITE_OK) {
+				fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(db));
+			}
+		}
+	}
+
+	sqlite3_finalize(stmt);
+}
+
+void update_max_density(std::vector<long long> const &zoom_max, sqlite3 *outdb) {
+	char *err;
+	std::string maxes = format_max_density(zoom_max);
+
+	char *sql = sqlite3_mprintf("UPDATE metadata SET value = %Q WHERE name = 'max_density';", maxes.c_str());
+	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "update max_density in metadata: %s\n", err);
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_free(sql);
+}
+
+static void update_metadata(sqlite3 *outdb, const char *name, const char *value) {
+	char *err;
+	char *sql = sqlite3_mprintf("UPDATE metadata SET value = %Q WHERE name = %Q;", value, name);
+	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "update %s in metadata: %s\n", name, err);
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_free(sql);
+}
+
+// The bounds and center of an updated tileset, from the scan of all the counts
+void update_extent(sqlite3 *outdb, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int maxzoom) {
+	char *value = sqlite3_mprintf("%f,%f,%d", midlon, midlat, maxzoom);
+	update_metadata(outdb, "center", value);
+	sqlite3_free(value);
+
+	value = sqlite3_mprintf("%f,%f,%f,%f", minlon, minlat, maxlon, maxlat);
+	update_metadata(outdb, "bounds", value);
+	sqlite3_free(value);
+}
+
+// Only the tiles that were made again went through encode_grid(),
+// so the layer statistics of an updated tileset are tallied again
+// from all of its tiles
+void update_layers(sqlite3 *outdb, std::string const &layername) {
+	layermap_entry lme(0);
+	lme.minzoom = 0;
+	lme.maxzoom = 0;
+
+	std::map<std::string, layermap_entry> lm;
+	auto fk = lm.insert(std::pair<std::string, layermap_entry>(layername, lme)).first;
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(outdb, "SELECT zoom_level, tile_data FROM tiles;", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 select prep failed: %s\n", sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+
+	mvt_zlib zlib;
+	std::string uncompressed;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		int z = sqlite3_column_int(stmt, 0);
+		std::string data((const char *) sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1));
+		std::string *pbf = &data;
+
+		if (is_compressed(data)) {
+			if (!zlib.decompress(data, uncompressed)) {
+				fprintf(stderr, "Couldn't decompress tile\n");
+				exit(EXIT_FAILURE);
+			}
+			pbf = &uncompressed;
+		}
+
+		mvt_tile tile;
+		try {
+			bool was_compressed;
+			if (!tile.decode(*pbf, was_compressed)) {
+				fprintf(stderr, "Couldn't parse tile\n");
+				exit(EXIT_FAILURE);
+			}
+		} catch (protozero::unknown_pbf_wire_type_exception &e) {
+			fprintf(stderr, "PBF decoding error in tile\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// Counted the way encode_grid() counts them: each bin is
+		// one point or one square, whether or not it shares a feature
+		for (size_t l = 0; l < tile.layers.size(); l++) {
+			mvt_layer const &layer = tile.layers[l];
+			if (layer.name != layername) {
+				continue;
+			}
+
+			for (size_t f = 0; f < layer.features.size(); f++) {
+				mvt_feature const &feature = layer.features[f];
+
+				for (size_t g = 0; g < feature.geometry.size(); g++) {
+					if (feature.type == mvt_point && feature.geometry[g].op == mvt_moveto) {
+						fk->second.points++;
+					} else if (feature.type == mvt_polygon && feature.geometry[g].op == mvt_closepath) {
+						fk->second.polygons++;
+					}
+				}
+
+				for (size_t t = 0; t + 1 < feature.tags.size(); t += 2) {
+					type_and_string attrib;
+					attrib.type = mvt_double;
+					attrib.string = std::to_string(layer.values[feature.tags[t + 1]].numeric_value.uint_value);
+					add_to_file_keys(fk->second.file_keys, layer.keys[feature.tags[t]], attrib);
+				}
+			}
+
+			if (layer.features.size() > 0) {
+				if (z < fk->second.minzoom) {
+					fk->second.minzoom = z;
+				}
+				if (z > fk->second.maxzoom) {
+					fk->second.maxzoom = z;
+				}
+			}
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	update_metadata(outdb, "json", mbtiles_layer_json(lm, true).c_str());
+}
+
+static void step_delete(sqlite3 *db, sqlite3_stmt *stmt) {
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "sqlite3 delete failed: %s\n", sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+	if (sqlite3_reset(stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(db));
+	}
+}
 
-	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('max_density', %Q);", maxes.c_str());
-	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "set name in metadata: %s\n", err);
+// Deletes the tiles that an incremental re-tiling is about to make again,
+// since some of them may not have anything in them any more
+void clear_changed(sqlite3 *db, int minzoom, int maxzoom) {
+	bool map = mbtiles_has_map(db);
+	const char *whole = map ? "DELETE FROM map WHERE zoom_level = ?;" : "DELETE FROM tiles WHERE zoom_level = ?;";
+	const char *one = map ? "DELETE FROM map WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?;" : "DELETE FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?;";
+
+	sqlite3_stmt *whole_stmt, *one_stmt;
+	if (sqlite3_prepare_v2(db, whole, -1, &whole_stmt, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(db, one, -1, &one_stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 delete prep failed: %s\n", sqlite3_errmsg(db));
 		exit(EXIT_FAILURE);
 	}
-	sqlite3_free(sql);
 
-	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('density_levels', %d);", levels);
-	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "set name in metadata: %s\n", err);
+	char *err = NULL;
+	if (sqlite3_exec(db, "BEGIN", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 BEGIN failed: %s\n", err);
 		exit(EXIT_FAILURE);
 	}
-	sqlite3_free(sql);
 
-	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('density_gamma', %f);", count_gamma);
-	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "set name in metadata: %s\n", err);
+	for (int z = minzoom; z <= maxzoom; z++) {
+		if (whole_zoom[z]) {
+			sqlite3_bind_int(whole_stmt, 1, z);
+			step_delete(db, whole_stmt);
+			continue;
+		}
+
+		// The changed tiles are in quadkey order, so the ones
+		// that share a tile at this zoom are next to each other
+		long long ox = -1, oy = -1;
+		for (size_t i = 0; i < changed_tiles.size(); i++) {
+			unsigned wx, wy;
+			decode(changed_tiles[i], &wx, &wy);
+			long long x = z == 0 ? 0 : wx >> (32 - z);
+			long long y = z == 0 ? 0 : wy >> (32 - z);
+
+			if (x != ox || y != oy) {
+				sqlite3_bind_int(one_stmt, 1, z);
+				sqlite3_bind_int64(one_stmt, 2, x);
+				sqlite3_bind_int64(one_stmt, 3, (1LL << z) - 1 - y);
+				step_delete(db, one_stmt);
+
+				ox = x;
+				oy = y;
+			}
+		}
+	}
+
+	if (sqlite3_exec(db, "COMMIT", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 COMMIT failed: %s\n", err);
 		exit(EXIT_FAILURE);
 	}
-	sqlite3_free(sql);
+
+	sqlite3_finalize(whole_stmt);
+	sqlite3_finalize(one_stmt);
 }
 
+// A tile taken from one of the tilesets being merged. Its data is
+// moved along from the reader thread to the retile thread, not copied.
+struct source_tile {
+	struct tile_reader *source;
+	int zoom;
+	int x;
+	int sorty;
+	std::string data;
+
+	int y() {
+		return (1LL << zoom) - 1 - sorty;
+	}
+};
+
+#define READ_AHEAD 16
+
+// A cursor through the tiles of one of the tilesets being merged.
+// The readers stay put in a vector while the merge runs, and only
+// pointers to them go into the priority queue. Each one has a thread
+// that reads the tileset's rows ahead of the merge into a queue.
 struct tile_reader {
 	sqlite3 *db = NULL;
 	sqlite3_stmt *stmt = NULL;
-	sqlite3 *outdb = NULL;
+	tile_writer *writer = NULL;
 	std::string name;
 	std::string layername;
 	std::string format;
+	size_t index = 0;
 
 	int zoom = 0;
 	int x = 0;
@@ -704,42 +1782,94 @@ struct tile_reader {
 	int density_levels;
 	double density_gamma;
 	std::vector<long long> max_density;
-	std::vector<long long> global_density;
-	std::map<std::string, layermap_entry> *layermap;
+	std::vector<density_table> const *densities;
+
+	bounded_queue<source_tile> *prefetch = NULL;
+	size_t read_ahead = READ_AHEAD;
+	std::vector<source_tile> ahead;
+	size_t ahead_used = 0;
+	pthread_t thread;
 
 	int y() {
 		return (1LL << zoom) - 1 - sorty;
 	}
 
-	// Comparisons are backwards because priority_queue puts highest first
-	bool operator<(const tile_reader r) const {
-		if (zoom > r.zoom) {
-			return true;
-		}
-		if (zoom < r.zoom) {
-			return false;
+	// Take the reader's next tile from its queue, returning false at the end
+	bool next() {
+		if (ahead_used >= ahead.size()) {
+			if (!prefetch->pop(ahead, read_ahead)) {
+				return false;
+			}
+			ahead_used = 0;
 		}
 
-		if (x > r.x) {
-			return true;
-		}
-		if (x < r.x) {
-			return false;
-		}
+		source_tile &st = ahead[ahead_used++];
+		zoom = st.zoom;
+		x = st.x;
+		sorty = st.sorty;
+		data.swap(st.data);
+
+		return true;
+	}
+};
 
-		if (sorty > r.sorty) {
-			return true;
+// Comparisons are backwards because priority_queue puts highest first
+struct tile_reader_order {
+	bool operator()(tile_reader const *a, tile_reader const *b) const {
+		if (a->zoom != b->zoom) {
+			return a->zoom > b->zoom;
 		}
-		if (sorty < r.sorty) {
-			return false;
+		if (a->x != b->x) {
+			return a->x > b->x;
 		}
-
-		if (data > r.data) {
-			return true;
+		if (a->sorty != b->sorty) {
+			return a->sorty > b->sorty;
 		}
+		return a->index > b->index;
+	}
+};
 
-		return false;
+// The reader's statement has already been stepped to its first row
+void *run_reader(void *v) {
+	tile_reader *r = (tile_reader *) v;
+
+	do {
+		source_tile st;
+		st.source = r;
+		st.zoom = sqlite3_column_int(r->stmt, 0);
+		st.x = sqlite3_column_int(r->stmt, 1);
+		st.sorty = sqlite3_column_int(r->stmt, 2);
+
+		const char *blob = (const char *) sqlite3_column_blob(r->stmt, 3);
+		size_t len = sqlite3_column_bytes(r->stmt, 3);
+		st.data.assign(blob, len);
+
+		r->prefetch->push(std::move(st));
+	} while (sqlite3_step(r->stmt) == SQLITE_ROW);
+
+	r->prefetch->close();
+	sqlite3_finalize(r->stmt);
+
+	if (sqlite3_close(r->db) != SQLITE_OK) {
+		fprintf(stderr, "%s: could not close database: %s\n", r->name.c_str(), sqlite3_errmsg(r->db));
+		exit(EXIT_FAILURE);
 	}
+
+	return NULL;
+}
+
+#define RETILE_CHUNK_BYTES 100000
+
+// A retile thread. The retile threads all take their work from one queue
+// of chunks, each of them a run of whole z/x/y groups of source tiles,
+// so that no thread sits idle while another one has work piled up.
+struct retiler {
+	bounded_queue<std::vector<source_tile>> *chunks;
+	std::map<std::string, layermap_entry> *layermap;
+	pthread_t thread;
+
+	size_t chunks_done = 0;
+	double busy = 0;
 };
 
 struct read_state {
@@ -759,227 +1889,251 @@ void user_read_data(png_structp png_ptr, png_bytep data, png_size_t length) {
 	state->off += length;
 }
 
-void *retile(void *v) {
-	std::vector<tile_reader *> *queue = (std::vector<tile_reader *> *) v;
-
-	tile t(0, 0);
-
-	for (size_t i = 0; i < queue->size(); i++) {
-		if ((*queue)[i]->format == std::string("png")) {
-			png_structp png_ptr;
-			png_infop info_ptr;
-
-			struct read_state state;
-			state.base = (*queue)[i]->data.c_str();
-			state.off = 0;
-			state.len = (*queue)[i]->data.length();
-
-			png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, fail, fail);
-			if (png_ptr == NULL) {
-				fprintf(stderr, "PNG init failed\n");
-				exit(EXIT_FAILURE);
-			}
+// The counts that the density levels of a source tileset stand for,
+// filled in as they are first needed
+struct level_counts {
+	double gamma = -1;
+	long long zoom_max = -1;
+	size_t density_levels = 0;
+	std::vector<long long> counts;
+
+	void use(double g, long long max, size_t dl) {
+		if (g != gamma || max != zoom_max || dl != density_levels) {
+			gamma = g;
+			zoom_max = max;
+			density_levels = dl;
+			counts.assign(256, -1);
+		}
+	}
 
-			info_ptr = png_create_info_struct(png_ptr);
-			if (info_ptr == NULL) {
-				fprintf(stderr, "PNG init failed\n");
-				exit(EXIT_FAILURE);
+	long long count(double density) {
+		if (density >= 0 && density < counts.size()) {
+			long long &c = counts[(size_t) density];
+			if (c < 0) {
+				c = density_count(density, gamma, zoom_max, density_levels);
 			}
+			return c;
+		}
 
-			png_set_read_fn(png_ptr, &state, user_read_data);
-			png_set_sig_bytes(png_ptr, 0);
-
-			png_read_png(png_ptr, info_ptr, 0, NULL);
+		return density_count(density, gamma, zoom_max, density_levels);
+	}
+};
 
-			png_uint_32 width, height;
-			int bit_depth;
-			int color_type, interlace_type;
+void *retile(void *v) {
+	retiler *rt = (retiler *) v;
 
-			png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
-			if (bit_depth != 8 || color_type != PNG_COLOR_TYPE_PALETTE || width != height) {
-				fprintf(stderr, "Misencoded PNG\n");
-				exit(EXIT_FAILURE);
-			}
+	tile t(0, 0);
+	level_counts lc;
+	tile_buffers buffers;
 
-			if (!t.active || t.z != (*queue)[i]->zoom || t.x != (*queue)[i]->x || t.y != (*queue)[i]->y() || t.count.size() != width * height) {
-				if (t.active) {
-					make_tile((*queue)[i]->outdb, t, t.z, log(sqrt(t.count.size())) / log(2), (*queue)[i]->global_density[t.z], (*queue)[i]->layername, (*queue)[i]->layermap);
-				}
+	std::vector<std::vector<source_tile>> batch;
+	while (rt->chunks->pop(batch, 1)) {
+		double before = pipeline_now();
 
-				t.active = true;
-				t.z = (*queue)[i]->zoom;
-				t.x = (*queue)[i]->x;
-				t.y = (*queue)[i]->y();
-				t.count.resize(width * height);
+		for (size_t b = 0; b < batch.size(); b++) {
+			std::vector<source_tile> &chunk = batch[b];
 
-				for (size_t j = 0; j < width * height; j++) {
-					t.count[j] = 0;
-				}
-			}
+			for (size_t i = 0; i < chunk.size(); i++) {
+				source_tile *s = &chunk[i];
 
-			double gamma = (*queue)[i]->density_gamma;
-			long long zoom_max = (*queue)[i]->max_density[(*queue)[i]->zoom];
-			size_t density_levels = (*queue)[i]->density_levels;
+				if (s->source->format == std::string("png")) {
+					png_structp png_ptr;
+					png_infop info_ptr;
 
-			png_bytepp row_pointers = png_get_rows(png_ptr, info_ptr);
-			for (size_t y = 0; y < height; y++) {
-				unsigned char *bytes = row_pointers[y];
+					struct read_state state;
+					state.base = s->data.c_str();
+					state.off = 0;
+					state.len = s->data.length();
 
-				for (size_t x = 0; x < width; x++) {
-					if (bytes[x] > 0) {
-						double bright = bytes[x];
-						long long count = ceil(exp(log(bright) * gamma) * zoom_max / exp(log(density_levels) * gamma));
-#if 0
-						int back = exp(log(exp(log(density_levels) * gamma) * count / zoom_max) / gamma);
-						if (back != bytes[x]) {
-							fprintf(stderr, "put in %d, got back %d (bitmap)\n", bytes[x], back);
-							exit(EXIT_FAILURE);
-						}
-#endif
-						t.count[width * y + x] += count;
+					png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, fail, fail);
+					if (png_ptr == NULL) {
+						fprintf(stderr, "PNG init failed\n");
+						exit(EXIT_FAILURE);
 					}
-				}
-			}
 
-			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		} else {
-			mvt_tile tile;
-
-			try {
-				bool was_compressed;
+					info_ptr = png_create_info_struct(png_ptr);
+					if (info_ptr == NULL) {
+						fprintf(stderr, "PNG init failed\n");
+						exit(EXIT_FAILURE);
+					}
 
-				if (!tile.decode((*queue)[i]->data, was_compressed)) {
-					fprintf(stderr, "Couldn't parse tile\n");
-					exit(EXIT_FAILURE);
-				}
-			} catch (protozero::unknown_pbf_wire_type_exception e) {
-				fprintf(stderr, "PBF decoding error in tile\n");
-				exit(EXIT_FAILURE);
-			}
+					png_set_read_fn(png_ptr, &state, user_read_data);
+					png_set_sig_bytes(png_ptr, 0);
 
-			for (size_t l = 0; l < tile.layers.size(); l++) {
-				mvt_layer &layer = tile.layers[l];
-				size_t extent = layer.extent;
+					png_read_png(png_ptr, info_ptr, 0, NULL);
 
-				double gamma = (*queue)[i]->density_gamma;
-				long long zoom_max = (*queue)[i]->max_density[(*queue)[i]->zoom];
-				size_t density_levels = (*queue)[i]->density_levels;
+					png_uint_32 width, height;
+					int bit_depth;
+					int color_type, interlace_type;
 
-				if (!t.active || t.z != (*queue)[i]->zoom || t.x != (*queue)[i]->x || t.y != (*queue)[i]->y() || t.count.size() != extent * extent) {
-					if (t.active) {
-						make_tile((*queue)[i]->outdb, t, t.z, log(sqrt(t.count.size())) / log(2), (*queue)[i]->global_density[t.z], (*queue)[i]->layername, (*queue)[i]->layermap);
+					png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+					if (bit_depth != 8 || color_type != PNG_COLOR_TYPE_PALETTE || width != height) {
+						fprintf(stderr, "Misencoded PNG\n");
+						exit(EXIT_FAILURE);
 					}
 
-					t.active = true;
-					t.z = (*queue)[i]->zoom;
-					t.x = (*queue)[i]->x;
-					t.y = (*queue)[i]->y();
-					t.count.resize(extent * extent);
-
-					for (size_t j = 0; j < extent * extent; j++) {
-						t.count[j] = 0;
-					}
-				}
+					if (!t.active || t.z != s->zoom || t.x != s->x || t.y != s->y() || t.count.size() != width * height) {
+						if (t.active) {
+							s->source->writer->write(t.z, t.x, t.y, make_tile(t, t.z, log(sqrt(t.count.size())) / log(2), (*s->source->densities)[t.z], s->source->layername, rt->layermap, buffers));
+						}
 
-				for (size_t f = 0; f < layer.features.size(); f++) {
-					mvt_feature &feat = layer.features[f];
-					double density = -1;
-					long long count = -1;
+						t.active = true;
+						t.z = s->zoom;
+						t.x = s->x;
+						t.y = s->y();
+						t.count.resize(width * height);
 
-					for (size_t tag = 0; tag + 1 < feat.tags.size(); tag += 2) {
-						if (feat.tags[tag] >= layer.keys.size()) {
-							fprintf(stderr, "Error: out of bounds feature key\n");
-							exit(EXIT_FAILURE);
-						}
-						if (feat.tags[tag + 1] >= layer.values.size()) {
-							fprintf(stderr, "Error: out of bounds feature value\n");
-							exit(EXIT_FAILURE);
+						for (size_t j = 0; j < width * height; j++) {
+							t.count[j] = 0;
 						}
+					}
 
-						std::string key = layer.keys[feat.tags[tag]];
-						mvt_value const &val = layer.values[feat.tags[tag + 1]];
+					double gamma = s->source->density_gamma;
+					long long zoom_max = s->source->max_density[s->zoom];
+					size_t density_levels = s->source->density_levels;
+					lc.use(gamma, zoom_max, density_levels);
 
-						if (key == std::string("density")) {
-							if (val.type == mvt_uint) {
-								density = val.numeric_value.uint_value;
-								count = ceil(exp(log(density) * gamma) * zoom_max / exp(log(density_levels) * gamma));
+					png_bytepp row_pointers = png_get_rows(png_ptr, info_ptr);
+					for (size_t y = 0; y < height; y++) {
+						unsigned char *bytes = row_pointers[y];
 
+						for (size_t x = 0; x < width; x++) {
+							if (bytes[x] > 0) {
+								long long count = lc.count(bytes[x]);
 #if 0
 								int back = exp(log(exp(log(density_levels) * gamma) * count / zoom_max) / gamma);
-								if (back != val.numeric_value.uint_value) {
-									fprintf(stderr, "put in %llu, got back %d (vector)\n", val.numeric_value.uint_value, back);
+								if (back != bytes[x]) {
+									fprintf(stderr, "put in %d, got back %d (bitmap)\n", bytes[x], back);
 									exit(EXIT_FAILURE);
 								}
 #endif
+								t.count[width * y + x] += count;
 							}
 						}
-						if (key == std::string("count")) {
-							if (val.type == mvt_uint) {
-								count = val.numeric_value.uint_value;
+					}
+
+					png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+				} else {
+					mvt_tile tile;
+
+					try {
+						bool was_compressed;
+						std::string *data = &s->data;
+
+						if (is_compressed(*data)) {
+							if (!buffers.zlib.decompress(*data, buffers.uncompressed)) {
+								fprintf(stderr, "Couldn't decompress tile\n");
+								exit(EXIT_FAILURE);
 							}
+							data = &buffers.uncompressed;
 						}
-					}
 
-					if (density < 0 && count < 0) {
-						fprintf(stderr, "Can't find density or count attribute in feature being merged\n");
+						if (!tile.decode(*data, was_compressed)) {
+							fprintf(stderr, "Couldn't parse tile\n");
+							exit(EXIT_FAILURE);
+						}
+					} catch (protozero::unknown_pbf_wire_type_exception e) {
+						fprintf(stderr, "PBF decoding error in tile\n");
 						exit(EXIT_FAILURE);
 					}
 
-					for (size_t g = 0; g < feat.geometry.size(); g++) {
-						// XXX This thinks it knows that the moveto is always the top left of the pixel
+					for (size_t l = 0; l < tile.layers.size(); l++) {
+						mvt_layer &layer = tile.layers[l];
+						size_t extent = layer.extent;
+
+						double gamma = s->source->density_gamma;
+						long long zoom_max = s->source->max_density[s->zoom];
+						size_t density_levels = s->source->density_levels;
+						lc.use(gamma, zoom_max, density_levels);
+
+						if (!t.active || t.z != s->zoom || t.x != s->x || t.y != s->y() || t.count.size() != extent * extent) {
+							if (t.active) {
+								s->source->writer->write(t.z, t.x, t.y, make_tile(t, t.z, log(sqrt(t.count.size())) / log(2), (*s->source->densities)[t.z], s->source->layername, rt->layermap, buffers));
+							}
+
+							t.active = true;
+							t.z = s->zoom;
+							t.x = s->x;
+							t.y = s->y();
+							t.count.resize(extent * extent);
 
-						if (feat.geometry[g].op == mvt_moveto) {
-							if (feat.geometry[g].x >= 0 &&
-							    feat.geometry[g].y >= 0 &&
-							    feat.geometry[g].x < (ssize_t) extent &&
-							    feat.geometry[g].y < (ssize_t) extent) {
-								t.count[extent * feat.geometry[g].y + feat.geometry[g].x] += count;
+							for (size_t j = 0; j < extent * extent; j++) {
+								t.count[j] = 0;
 							}
 						}
-					}
-				}
-			}
-		}
-	}
 
-	if (t.active) {
-		make_tile((*queue)[0]->outdb, t, t.z, log(sqrt(t.count.size())) / log(2), (*queue)[0]->global_density[t.z], (*queue)[0]->layername, (*queue)[0]->layermap);
-	}
+						for (size_t f = 0; f < layer.features.size(); f++) {
+							mvt_feature &feat = layer.features[f];
+							double density = -1;
+							long long count = -1;
 
-	return NULL;
-}
+							for (size_t tag = 0; tag + 1 < feat.tags.size(); tag += 2) {
+								if (feat.tags[tag] >= layer.keys.size()) {
+									fprintf(stderr, "Error: out of bounds feature key\n");
+									exit(EXIT_FAILURE);
+								}
+								if (feat.tags[tag + 1] >= layer.values.size()) {
+									fprintf(stderr, "Error: out of bounds feature value\n");
+									exit(EXIT_FAILURE);
+								}
 
-void merge(std::vector<tile_reader> &r, size_t cpus, std::vector<std::map<std::string, layermap_entry>> &layermaps) {
-	std::vector<std::vector<tile_reader *>> queues;
-	queues.resize(cpus);
+								std::string key = layer.keys[feat.tags[tag]];
+								mvt_value const &val = layer.values[feat.tags[tag + 1]];
 
-	size_t o = 0;
-	for (size_t i = 0; i < r.size(); i++) {
-		r[i].layermap = &layermaps[o];
-		queues[o].push_back(&r[i]);
+								if (key == std::string("density")) {
+									if (val.type == mvt_uint) {
+										density = val.numeric_value.uint_value;
+										count = lc.count(density);
 
-		if (i + 1 < r.size() && (r[i].x != r[i + 1].x || r[i].y() != r[i + 1].y() || r[i].zoom != r[i + 1].zoom)) {
-			o = (o + 1) % cpus;
-		}
-	}
+#if 0
+										int back = exp(log(exp(log(density_levels) * gamma) * count / zoom_max) / gamma);
+										if (back != val.numeric_value.uint_value) {
+											fprintf(stderr, "put in %llu, got back %d (vector)\n", val.numeric_value.uint_value, back);
+											exit(EXIT_FAILURE);
+										}
+#endif
+									}
+								}
+								if (key == std::string("count")) {
+									if (val.type == mvt_uint) {
+										count = val.numeric_value.uint_value;
+									}
+								}
+							}
 
-	pthread_t pthreads[cpus];
+							if (density < 0 && count < 0) {
+								fprintf(stderr, "Can't find density or count attribute in feature being merged\n");
+								exit(EXIT_FAILURE);
+							}
 
-	for (size_t i = 0; i < cpus; i++) {
-		if (pthread_create(&pthreads[i], NULL, retile, &queues[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
-		}
-	}
+							for (size_t g = 0; g < feat.geometry.size(); g++) {
+								// XXX This thinks it knows that the moveto is always the top left of the pixel
 
-	for (size_t i = 0; i < cpus; i++) {
-		void *ret;
+								if (feat.geometry[g].op == mvt_moveto) {
+									if (feat.geometry[g].x >= 0 &&
+									    feat.geometry[g].y >= 0 &&
+									    feat.geometry[g].x < (ssize_t) extent &&
+									    feat.geometry[g].y < (ssize_t) extent) {
+										t.count[extent * feat.geometry[g].y + feat.geometry[g].x] += count;
+									}
+								}
+							}
+						}
+					}
+				}
+			}
 
-		if (pthread_join(pthreads[i], &ret) != 0) {
-			perror("pthread_join");
-			exit(EXIT_FAILURE);
+			if (t.active) {
+				chunk[0].source->writer->write(t.z, t.x, t.y, make_tile(t, t.z, log(sqrt(t.count.size())) / log(2), (*chunk[0].source->densities)[t.z], chunk[0].source->layername, rt->layermap, buffers));
+				t.active = false;
+			}
 		}
+
+		rt->busy += pipeline_now() - before;
+		rt->chunks_done++;
 	}
+
+	return NULL;
 }
 
 std::vector<long long> parse_max_density(const unsigned char *v) {
@@ -999,9 +2153,28 @@ std::vector<long long> parse_max_density(const unsigned char *v) {
 	return out;
 }
 
-void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms, std::vector<long long> &zoom_max, double &midlat, double &midlon, double &minlat, double &minlon, double &maxlat, double &maxlon, std::string const &layername, std::vector<std::map<std::string, layermap_entry>> &layermaps) {
+std::vector<long long> read_max_density(sqlite3 *db, const char *fname) {
+	std::vector<long long> out;
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, "SELECT value from metadata where name = 'max_density';", -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			out = parse_max_density(sqlite3_column_text(stmt, 0));
+		} else {
+			fprintf(stderr, "%s: No max_density value in metadata\n", fname);
+			exit(EXIT_FAILURE);
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	return out;
+}
+
+void merge_tiles(char **fnames, size_t n, size_t cpus, size_t detail, tile_writer *writer, int zooms, std::vector<long long> &zoom_max, double &midlat, double &midlon, double &minlat, double &minlon, double &maxlat, double &maxlon, std::string const &layername, std::vector<std::map<std::string, layermap_entry>> &layermaps) {
 	std::vector<tile_reader> readers;
+	readers.reserve(n);
 	size_t total_rows = 0;
+	size_t total_bytes = 0;
 	size_t seq = 0;
 	size_t oprogress = 999;
 	size_t biggest = 0;
@@ -1009,24 +2182,22 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 	for (size_t i = 0; i < n; i++) {
 		tile_reader r;
 		r.name = fnames[i];
-		r.outdb = outdb;
+		r.writer = writer;
+		r.layername = layername;
 
 		if (sqlite3_open(fnames[i], &r.db) != SQLITE_OK) {
 			fprintf(stderr, "%s: %s\n", fnames[i], sqlite3_errmsg(r.db));
 			exit(EXIT_FAILURE);
 		}
 
-		sqlite3_stmt *stmt;
-		if (sqlite3_prepare_v2(r.db, "SELECT value from metadata where name = 'max_density';", -1, &stmt, NULL) == SQLITE_OK) {
-			if (sqlite3_step(stmt) == SQLITE_ROW) {
-				r.max_density = parse_max_density(sqlite3_column_text(stmt, 0));
-			} else {
-				fprintf(stderr, "%s: No max_density value in metadata\n", fnames[i]);
-				exit(EXIT_FAILURE);
-			}
-			sqlite3_finalize(stmt);
+		struct stat st;
+		if (stat(fnames[i], &st) == 0) {
+			total_bytes += st.st_size;
 		}
 
+		r.max_density = read_max_density(r.db, fnames[i]);
+
+		sqlite3_stmt *stmt;
 		if (sqlite3_prepare_v2(r.db, "SELECT value from metadata where name = 'density_levels';", -1, &stmt, NULL) == SQLITE_OK) {
 			if (sqlite3_step(stmt) == SQLITE_ROW) {
 				r.density_levels = sqlite3_column_int(stmt, 0);
@@ -1067,7 +2238,11 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 			sqlite3_finalize(stmt);
 		}
 
-		if (sqlite3_prepare_v2(r.db, "SELECT max(rowid) from tiles;", -1, &stmt, NULL) == SQLITE_OK) {
+		const char *rows = "SELECT max(rowid) from tiles;";
+		if (mbtiles_has_map(r.db)) {
+			rows = "SELECT max(rowid) from map;";
+		}
+		if (sqlite3_prepare_v2(r.db, rows, -1, &stmt, NULL) == SQLITE_OK) {
 			if (sqlite3_step(stmt) == SQLITE_ROW) {
 				total_rows += sqlite3_column_int(stmt, 0);
 			}
@@ -1081,23 +2256,6 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 		}
 
 		if (sqlite3_step(r.stmt) == SQLITE_ROW) {
-			r.zoom = sqlite3_column_int(r.stmt, 0);
-			r.x = sqlite3_column_int(r.stmt, 1);
-			r.sorty = sqlite3_column_int(r.stmt, 2);
-			r.layername = layername;
-
-			const char *data = (const char *) sqlite3_column_blob(r.stmt, 3);
-			size_t len = sqlite3_column_bytes(r.stmt, 3);
-			r.data = std::string(data, len);
-
-			if (r.zoom == zooms - 1 && r.data.size() > biggest) {
-				biggest = r.data.size();
-				projection->unproject(r.x, r.y(), r.zoom, &midlon, &midlat);
-			}
-
-			readers.push_back(r);
-			seq++;
-
 			// This check is here instead of above so the bounding box is only affected if there are
 			// tiles in the tileset being merged.
 
@@ -1122,87 +2280,368 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 				}
 				sqlite3_finalize(stmt);
 			}
+
+			r.index = readers.size();
+			readers.push_back(std::move(r));
 		} else {
 			sqlite3_finalize(r.stmt);
 
-			if (sqlite3_close(r.db) != SQLITE_OK) {
-				fprintf(stderr, "%s: could not close database: %s\n", r.name.c_str(), sqlite3_errmsg(r.db));
-				exit(EXIT_FAILURE);
+			if (sqlite3_close(r.db) != SQLITE_OK) {
+				fprintf(stderr, "%s: could not close database: %s\n", r.name.c_str(), sqlite3_errmsg(r.db));
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	// XXX This doesn't detect if two sources brighten the same pixel together
+	for (size_t i = 0; i < readers.size(); i++) {
+		if (readers[i].max_density.size() > zoom_max.size()) {
+			zoom_max.resize(readers[i].max_density.size());
+		}
+
+		for (size_t j = 0; j < readers[i].max_density.size(); j++) {
+			if (readers[i].max_density[j] > zoom_max[j]) {
+				zoom_max[j] = readers[i].max_density[j];
+			}
+		}
+	}
+
+	std::vector<density_table> densities = make_density_tables(zoom_max);
+
+	// With a memory budget, fewer retile threads are used if their grids
+	// and chunks would not fit, and the readers read fewer tiles ahead if
+	// what they hold, at about the average size of the tiles being merged,
+	// would not fit in what is left. Every tileset still needs a reader.
+	size_t read_ahead = READ_AHEAD;
+	if (memory_budget > 0) {
+		size_t retile_bytes = 3 * (sizeof(long long) << (2 * detail)) + 4 * RETILE_CHUNK_BYTES;
+		// for each tile that each reader reads ahead, in its queue and as many taken from it
+		size_t reader_bytes = 2 * readers.size() * (total_rows > 0 ? total_bytes / total_rows : 0);
+
+		if (memory_budget < retile_bytes + reader_bytes) {
+			fprintf(stderr, "Warning: merging %zu tilesets with detail %zu takes about %zu MB, more than the memory budget\n", readers.size(), detail, (retile_bytes + reader_bytes) / 1024 / 1024);
+		} else if (budget_count(retile_bytes, cpus) < cpus && !quiet) {
+			fprintf(stderr, "Using %zu threads to stay within the memory budget\n", budget_count(retile_bytes, cpus));
+		}
+		cpus = budget_count(retile_bytes, cpus);
+
+		if (reader_bytes > 0) {
+			size_t left = memory_budget > cpus * retile_bytes ? memory_budget - cpus * retile_bytes : 0;
+			read_ahead = left / reader_bytes;
+			if (read_ahead > READ_AHEAD) {
+				read_ahead = READ_AHEAD;
+			}
+			if (read_ahead < 1) {
+				read_ahead = 1;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < readers.size(); i++) {
+		readers[i].densities = &densities;
+		readers[i].read_ahead = read_ahead;
+		readers[i].prefetch = new bounded_queue<source_tile>(read_ahead);
+
+		if (pthread_create(&readers[i].thread, NULL, run_reader, &readers[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bounded_queue<std::vector<source_tile>> chunks(4 * cpus);
+
+	std::vector<retiler> retilers;
+	retilers.resize(cpus);
+	for (size_t i = 0; i < cpus; i++) {
+		retilers[i].chunks = &chunks;
+		retilers[i].layermap = &layermaps[i];
+
+		if (pthread_create(&retilers[i].thread, NULL, retile, &retilers[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	std::priority_queue<tile_reader *, std::vector<tile_reader *>, tile_reader_order> reader_q;
+	for (size_t i = 0; i < readers.size(); i++) {
+		if (readers[i].next()) {
+			if (readers[i].zoom == zooms - 1 && readers[i].data.size() > biggest) {
+				biggest = readers[i].data.size();
+				projection->unproject(readers[i].x, readers[i].y(), readers[i].zoom, &midlon, &midlat);
+			}
+
+			reader_q.push(&readers[i]);
+			seq++;
+		}
+	}
+
+	// Tiles are handed to the retile threads in chunks of whole z/x/ys,
+	// while the reader threads go on reading the tiles that come after them.
+	// The time to retile a tile goes mostly to decoding it, so a chunk is
+	// cut off once it holds enough data, not after a fixed number of tiles:
+	// a dense tile may be a chunk by itself, but empty ones go together.
+	std::vector<source_tile> chunk;
+	size_t chunk_bytes = 0;
+	while (reader_q.size() != 0) {
+		tile_reader *r = reader_q.top();
+		reader_q.pop();
+
+		if (chunk_bytes >= RETILE_CHUNK_BYTES) {
+			source_tile &last = chunk[chunk.size() - 1];
+			if (r->x != last.x || r->y() != last.y() || r->zoom != last.zoom) {
+				chunks.push(std::move(chunk));
+				chunk.clear();
+				chunk_bytes = 0;
+			}
+		}
+
+		chunk_bytes += r->data.size();
+		chunk.push_back(source_tile());
+		source_tile &st = chunk.back();
+		st.source = r;
+		st.zoom = r->zoom;
+		st.x = r->x;
+		st.sorty = r->sorty;
+		st.data.swap(r->data);
+
+		if (r->next()) {
+			if (r->zoom == zooms - 1 && r->data.size() > biggest) {
+				biggest = r->data.size();
+				projection->unproject(r->x, r->y(), r->zoom, &midlon, &midlat);
+			}
+
+			reader_q.push(r);
+			seq++;
+
+			size_t progress = 100 * seq / total_rows;
+			if (progress != oprogress) {
+				if (!quiet) {
+					fprintf(stderr, "  %zu%%\r", progress);
+					oprogress = progress;
+				}
+			}
+		}
+	}
+
+	if (chunk.size() > 0) {
+		chunks.push(std::move(chunk));
+	}
+
+	chunks.close();
+	for (size_t i = 0; i < cpus; i++) {
+		void *ret;
+
+		if (pthread_join(retilers[i].thread, &ret) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (report_timing) {
+		double least = 0, most = 0;
+		for (size_t i = 0; i < cpus; i++) {
+			if (i == 0 || retilers[i].busy < least) {
+				least = retilers[i].busy;
+			}
+			if (i == 0 || retilers[i].busy > most) {
+				most = retilers[i].busy;
 			}
 		}
+
+		fprintf(stderr, "retile: %zu threads, %zu chunks, %.3fs to %.3fs busy per thread, %.3fs waiting for chunks\n", cpus, chunks.pushes, least, most, chunks.pop_wait);
 	}
 
-	// XXX This doesn't detect if two sources brighten the same pixel together
 	for (size_t i = 0; i < readers.size(); i++) {
-		if (readers[i].max_density.size() > zoom_max.size()) {
-			zoom_max.resize(readers[i].max_density.size());
+		void *ret;
+
+		if (pthread_join(readers[i].thread, &ret) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
 		}
+		delete readers[i].prefetch;
+	}
+}
 
-		for (size_t j = 0; j < readers[i].max_density.size(); j++) {
-			if (readers[i].max_density[j] > zoom_max[j]) {
-				zoom_max[j] = readers[i].max_density[j];
+// Making single tiles on demand, straight from a .count file, instead of
+// making all of them ahead of time. The records for a tile are found by
+// binary search, binned as run_tile() bins them, and encoded by make_tile(),
+// so each tile is the same as the one in a tileset made with the same options.
+
+// The normalization that tiling the whole file would find: half the largest
+// bin at each zoom level, fitted to a line from minzoom up by regress().
+// Each bin is a run of records whose quadkeys share a prefix.
+std::vector<long long> find_max_density(count_file const &cf, size_t zooms, size_t minzoom, size_t detail) {
+	std::vector<long long> max(zooms, 0);
+	std::vector<unsigned long long> prefix(zooms, 0);
+	std::vector<long long> sum(zooms, 0);
+
+	for (size_t i = 0; i < cf.nrecords; i++) {
+		unsigned long long key = count_record_key(cf, i);
+		long long count = count_record_count(cf, i);
+
+		for (size_t z = minzoom; z < zooms; z++) {
+			unsigned long long p = key;
+			if (z + detail < 32) {
+				p >>= 64 - 2 * (z + detail);
+			}
+
+			if (i == 0 || p != prefix[z]) {
+				prefix[z] = p;
+				sum[z] = 0;
+			}
+
+			sum[z] += count;
+			if (sum[z] > max[z]) {
+				max[z] = sum[z];
 			}
 		}
 	}
 
-	std::priority_queue<tile_reader> reader_q;
-	for (size_t i = 0; i < readers.size(); i++) {
-		readers[i].global_density = zoom_max;
-		reader_q.push(readers[i]);
+	for (size_t z = 0; z < zooms; z++) {
+		max[z] /= 2;
 	}
-	readers.clear();
 
-	std::vector<tile_reader> to_merge;
-	while (reader_q.size() != 0) {
-		tile_reader r = reader_q.top();
-		reader_q.pop();
+	regress(max, minzoom);
+	return max;
+}
 
-		if (to_merge.size() > 50 * cpus) {
-			tile_reader &last = to_merge[to_merge.size() - 1];
-			if (r.x != last.x || r.y() != last.y() || r.zoom != last.zoom) {
-				merge(to_merge, cpus, layermaps);
-				to_merge.clear();
-			}
+struct tile_renderer {
+	count_file counts;
+	size_t minzoom;
+	size_t detail;
+	std::vector<density_table> densities;
+	std::string layername;
+	std::map<std::string, layermap_entry> layermap;
+	tile_buffers buffers;
+	tile grid;
+
+	// The most recently made tiles, most recent first, found by
+	// zoom and first quadkey
+	typedef std::pair<int, unsigned long long> tile_key;
+	typedef std::list<std::pair<tile_key, std::string>> recent_list;
+
+	size_t cache_size;
+	size_t cache_limit = 0;  // bytes of tiles, if there is a memory budget
+	size_t cache_bytes = 0;
+	recent_list recent;
+	std::map<tile_key, recent_list::iterator> cached;
+	size_t hits = 0;
+	size_t misses = 0;
+
+	tile_renderer(const char *fname, std::vector<long long> const &zoom_max, size_t zoom, size_t dim, std::string const &name, size_t cache)
+	    : minzoom(zoom), detail(dim), densities(make_density_tables(zoom_max)), layername(name), grid(dim, 0), cache_size(cache) {
+		count_open(counts, fname);
+
+		layermap_entry lme(0);
+		lme.minzoom = 0;
+		lme.maxzoom = 0;
+		layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
+	}
+
+	~tile_renderer() {
+		count_close(counts);
+	}
+};
+
+// Makes the tile z/x/y, or finds it in the cache, returning false if
+// it is outside the tileset. The tile is empty if nothing is in it.
+bool render_tile(tile_renderer &r, int z, long long x, long long y, std::string &out) {
+	if (z < (int) r.minzoom || z >= (int) r.densities.size() || z + r.detail > 32 ||
+	    x < 0 || y < 0 || x >= (1LL << z) || y >= (1LL << z)) {
+		return false;
+	}
+
+	unsigned long long start, end;
+	calc_tile_edges(z, x, y, start, end);
+
+	tile_renderer::tile_key key(z, start);
+	auto found = r.cached.find(key);
+	if (found != r.cached.end()) {
+		r.recent.splice(r.recent.begin(), r.recent, found->second);
+		out = found->second->second;
+		r.hits++;
+		return true;
+	}
+	r.misses++;
+
+	tile &t = r.grid;
+	t.z = z;
+	t.x = x;
+	t.y = y;
+	t.count.assign((1U << r.detail) * (1U << r.detail), 0);
+
+	size_t shift = 32 - (z + r.detail);
+	unsigned mask = (1U << r.detail) - 1;
+	bool anything = false;
+
+	for (size_t i = count_find(r.counts, start); i < r.counts.nrecords; i++) {
+		unsigned long long index = count_record_key(r.counts, i);
+		if (index > end) {
+			break;
 		}
 
-		to_merge.push_back(r);
+		unsigned wx, wy;
+		decode(index, &wx, &wy);
 
-		if (sqlite3_step(r.stmt) == SQLITE_ROW) {
-			r.zoom = sqlite3_column_int(r.stmt, 0);
-			r.x = sqlite3_column_int(r.stmt, 1);
-			r.sorty = sqlite3_column_int(r.stmt, 2);
-			r.layername = layername;
+		unsigned px = ((unsigned long long) wx >> shift) & mask;
+		unsigned py = ((unsigned long long) wy >> shift) & mask;
 
-			const char *data = (const char *) sqlite3_column_blob(r.stmt, 3);
-			size_t len = sqlite3_column_bytes(r.stmt, 3);
-			r.data = std::string(data, len);
+		t.count[py * (1 << r.detail) + px] += count_record_count(r.counts, i);
+		anything = true;
+	}
 
-			if (r.zoom == zooms - 1 && r.data.size() > biggest) {
-				biggest = r.data.size();
-				projection->unproject(r.x, r.y(), r.zoom, &midlon, &midlat);
-			}
+	out.clear();
+	if (anything) {
+		out = make_tile(t, z, r.detail, r.densities[z], r.layername, &r.layermap, r.buffers);
+	}
 
-			reader_q.push(r);
-			seq++;
+	if (r.cache_size > 0) {
+		r.recent.push_front(std::pair<tile_renderer::tile_key, std::string>(key, out));
+		r.cached.insert(std::pair<tile_renderer::tile_key, tile_renderer::recent_list::iterator>(key, r.recent.begin()));
+		r.cache_bytes += out.size();
 
-			size_t progress = 100 * seq / total_rows;
-			if (progress != oprogress) {
-				if (!quiet) {
-					fprintf(stderr, "  %zu%%\r", progress);
-					oprogress = progress;
-				}
-			}
-		} else {
-			sqlite3_finalize(r.stmt);
+		while (r.recent.size() > r.cache_size || (r.cache_limit > 0 && r.cache_bytes > r.cache_limit)) {
+			r.cache_bytes -= r.recent.back().second.size();
+			r.cached.erase(r.recent.back().first);
+			r.recent.pop_back();
+		}
+	}
 
-			if (sqlite3_close(r.db) != SQLITE_OK) {
-				fprintf(stderr, "%s: could not close database: %s\n", r.name.c_str(), sqlite3_errmsg(r.db));
+	return true;
+}
+
+// Answers requests for tiles, one z/x/y per line, with a line giving the
+// length of the tile in bytes followed by the tile itself, or with a line
+// beginning "error:". An empty tile has a length of 0.
+void serve_tiles(tile_renderer &r, FILE *in, FILE *out) {
+	char line[2000];
+	std::string data;
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		const char *s = line;
+		while (*s == '/') {
+			s++;
+		}
+
+		int z;
+		long long x, y;
+		if (sscanf(s, "%d/%lld/%lld", &z, &x, &y) != 3) {
+			fprintf(out, "error: not a z/x/y tile\n");
+		} else if (!render_tile(r, z, x, y, data)) {
+			fprintf(out, "error: %d/%lld/%lld is not in the tileset\n", z, x, y);
+		} else {
+			fprintf(out, "%zu\n", data.size());
+			if (fwrite(data.data(), sizeof(char), data.size(), out) != data.size()) {
+				perror("fwrite");
 				exit(EXIT_FAILURE);
 			}
 		}
-	}
 
-	merge(to_merge, cpus, layermaps);
+		if (fflush(out) != 0) {
+			perror("fflush");
+			exit(EXIT_FAILURE);
+		}
+	}
 }
 
 int main(int argc, char **argv) {
@@ -1210,17 +2649,111 @@ int main(int argc, char **argv) {
 	extern char *optarg;
 
 	char *outfile = NULL;
+	output_kind outkind = output_mbtiles;
 	int minzoom = 0;
 	int maxzoom = -1;
 	int bin = -1;
 	bool force = false;
 	size_t detail = 9;
-	size_t cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t cpus = available_cpus();
 	std::string layername = "count";
 
+	// Long options that have no single-letter equivalent
+	enum {
+		OPT_BBOX = 256,
+		OPT_TILES,
+		OPT_DELTA,
+		OPT_PREVIOUS,
+		OPT_TOLERANCE,
+		OPT_RENDER,
+		OPT_SERVE,
+		OPT_MAX_DENSITY,
+		OPT_CACHE,
+		OPT_MEMORY,
+	};
+
+	static struct option long_options[] = {
+		{"bbox", required_argument, NULL, OPT_BBOX},
+		{"tiles", required_argument, NULL, OPT_TILES},
+		{"delta", required_argument, NULL, OPT_DELTA},
+		{"previous", required_argument, NULL, OPT_PREVIOUS},
+		{"tolerance", required_argument, NULL, OPT_TOLERANCE},
+		{"render", required_argument, NULL, OPT_RENDER},
+		{"serve", no_argument, NULL, OPT_SERVE},
+		{"max-density", required_argument, NULL, OPT_MAX_DENSITY},
+		{"cache", required_argument, NULL, OPT_CACHE},
+		{"memory", required_argument, NULL, OPT_MEMORY},
+		{NULL, 0, NULL, 0},
+	};
+
+	const char *delta = NULL;
+	const char *previous = NULL;
+
+	// For making tiles on demand instead of a tileset
+	const char *render = NULL;
+	bool serve = false;
+	const char *max_density = NULL;
+	size_t cache_size = 1000;
+
 	int i;
-	while ((i = getopt(argc, argv, "fz:Z:s:a:o:p:d:l:m:M:g:bwc:qn:y:1kKPB:")) != -1) {
+	while ((i = getopt_long(argc, argv, "fz:Z:s:a:o:e:E:p:d:l:m:M:g:bwc:qn:y:1kKPB:TDC:F:", long_options, NULL)) != -1) {
 		switch (i) {
+		case OPT_BBOX:
+			if (!region_add_bbox(tile_region, optarg)) {
+				fprintf(stderr, "%s: --bbox %s is not minlon,minlat,maxlon,maxlat\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_TILES:
+			if (!region_add_tiles(tile_region, optarg)) {
+				fprintf(stderr, "%s: --tiles %s is not a list of z/x/y tiles\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_DELTA:
+		case OPT_PREVIOUS:
+			if (delta != NULL || previous != NULL) {
+				fprintf(stderr, "%s: only one of --delta and --previous can be specified\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			if (i == OPT_DELTA) {
+				delta = optarg;
+			} else {
+				previous = optarg;
+			}
+			incremental = true;
+			break;
+
+		case OPT_TOLERANCE:
+			max_density_tolerance = atof(optarg);
+			if (max_density_tolerance < 0) {
+				fprintf(stderr, "%s: --tolerance %s must not be negative\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_RENDER:
+			render = optarg;
+			break;
+
+		case OPT_SERVE:
+			serve = true;
+			break;
+
+		case OPT_MAX_DENSITY:
+			max_density = optarg;
+			break;
+
+		case OPT_CACHE:
+			cache_size = atoll(optarg);
+			break;
+
+		case OPT_MEMORY:
+			set_memory_budget(optarg, argv[0]);
+			break;
+
 		case 'B':
 			brighten = atof(optarg);
 			break;
@@ -1257,6 +2790,41 @@ int main(int argc, char **argv) {
 			quiet = true;
 			break;
 
+		case 'T':
+			report_timing = true;
+			break;
+
+		case 'D':
+			deduplicate = true;
+			break;
+
+		case 'C':
+			compression_level = atoi(optarg);
+			if (compression_level < 0 || compression_level > 9) {
+				fprintf(stderr, "%s: compression level %s must be between 0 and 9\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'F':
+			if (strcmp(optarg, "none") == 0) {
+				png_filter = PNG_FILTER_NONE;
+			} else if (strcmp(optarg, "sub") == 0) {
+				png_filter = PNG_FILTER_SUB;
+			} else if (strcmp(optarg, "up") == 0) {
+				png_filter = PNG_FILTER_UP;
+			} else if (strcmp(optarg, "avg") == 0) {
+				png_filter = PNG_FILTER_AVG;
+			} else if (strcmp(optarg, "paeth") == 0) {
+				png_filter = PNG_FILTER_PAETH;
+			} else if (strcmp(optarg, "all") == 0) {
+				png_filter = PNG_ALL_FILTERS;
+			} else {
+				fprintf(stderr, "%s: unknown PNG filter %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'k':
 			limit_tile_sizes = false;
 			break;
@@ -1318,7 +2886,18 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'o':
+		case 'e':
+		case 'E':
+			if (outfile != NULL) {
+				fprintf(stderr, "%s: only one of -o, -e, and -E can be specified\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
 			outfile = optarg;
+			if (i == 'e') {
+				outkind = output_directory;
+			} else if (i == 'E') {
+				outkind = output_archive;
+			}
 			break;
 
 		case '1':
@@ -1332,8 +2911,123 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (!(include_count || include_density)) {
+		include_density = true;
+	}
+
+	if (render != NULL || serve) {
+		if (outfile != NULL || tile_region.rects.size() > 0 || incremental) {
+			fprintf(stderr, "%s: --render and --serve make tiles on demand, not a tileset\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (optind + 1 != argc) {
+			usage(argv);
+			exit(EXIT_FAILURE);
+		}
+
+		// The normalization comes from --max-density, either from a tileset
+		// made from the same .count file or as a list. A file whose name
+		// looks like a list, such as 2024-06.mbtiles, is still a file.
+		std::vector<long long> zoom_max;
+		if (max_density != NULL) {
+			struct stat st;
+			if (stat(max_density, &st) != 0) {
+				if (max_density[0] == '\0' || strspn(max_density, "0123456789,") != strlen(max_density)) {
+					fprintf(stderr, "%s: --max-density %s: not a tileset or a list of densities\n", argv[0], max_density);
+					exit(EXIT_FAILURE);
+				}
+				zoom_max = parse_max_density((const unsigned char *) max_density);
+			} else {
+				sqlite3 *db;
+				if (sqlite3_open_v2(max_density, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+					fprintf(stderr, "%s: %s\n", max_density, sqlite3_errmsg(db));
+					exit(EXIT_FAILURE);
+				}
+				zoom_max = read_max_density(db, max_density);
+				sqlite3_close(db);
+			}
+		}
+
+		size_t zooms;
+		if (maxzoom >= 0) {
+			zooms = maxzoom + 1;
+		} else if (bin >= 0) {
+			zooms = bin - (int) detail + 1;
+		} else if (zoom_max.size() > 0) {
+			zooms = zoom_max.size();
+		} else {
+			fprintf(stderr, "%s: Must specify either maxzoom (-z) or bin size (-s)\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (zooms < 1 || zooms - 1 + detail > 32 || (int) zooms <= minzoom) {
+			fprintf(stderr, "%s: maxzoom %zu plus detail %zu must be from minzoom %d to 32\n", argv[0], zooms - 1, detail, minzoom);
+			exit(EXIT_FAILURE);
+		}
+		if (zoom_max.size() > 0 && zoom_max.size() != zooms) {
+			fprintf(stderr, "%s: --max-density has %zu zoom levels, not %zu\n", argv[0], zoom_max.size(), zooms);
+			exit(EXIT_FAILURE);
+		}
+
+		if (zoom_max.size() == 0) {
+			count_file cf;
+			count_open(cf, argv[optind], false);
+			zoom_max = find_max_density(cf, zooms, minzoom, detail);
+			count_close(cf);
+
+			if (!quiet) {
+				fprintf(stderr, "--max-density %s\n", format_max_density(zoom_max).c_str());
+			}
+		}
+
+		tile_renderer r(argv[optind], zoom_max, minzoom, detail, layername, cache_size);
+
+		// With a memory budget, the cache gives up its oldest tiles to stay
+		// within what is left after the grids that the tiles are made from
+		if (memory_budget > 0) {
+			size_t grid_bytes = 3 * (sizeof(long long) << (2 * detail));
+			if (memory_budget < grid_bytes) {
+				fprintf(stderr, "%s: Warning: making tiles with detail %zu takes about %zu MB, more than the memory budget\n", argv[0], detail, grid_bytes / 1024 / 1024);
+			}
+			if (memory_budget <= grid_bytes) {
+				r.cache_size = 0;
+			} else {
+				r.cache_limit = memory_budget - grid_bytes;
+			}
+		}
+
+		if (render != NULL) {
+			int z;
+			long long x, y;
+			std::string data;
+			if (sscanf(render, "%d/%lld/%lld", &z, &x, &y) != 3) {
+				fprintf(stderr, "%s: --render %s is not a z/x/y tile\n", argv[0], render);
+				exit(EXIT_FAILURE);
+			}
+			if (!render_tile(r, z, x, y, data)) {
+				fprintf(stderr, "%s: %s is not in the tileset\n", argv[0], render);
+				exit(EXIT_FAILURE);
+			}
+			if (fwrite(data.data(), sizeof(char), data.size(), stdout) != data.size()) {
+				perror("fwrite");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (serve) {
+			serve_tiles(r, stdin, stdout);
+		}
+
+		if (report_timing) {
+			fprintf(stderr, "render: %zu tiles made, %zu from the cache\n", r.misses, r.hits);
+		}
+		if (report_timing || memory_budget > 0) {
+			report_memory(argv[0]);
+		}
+		return 0;
+	}
+
 	if (outfile == NULL) {
-		fprintf(stderr, "%s: must specify -o output.mbtiles\n", argv[0]);
+		fprintf(stderr, "%s: must specify -o output.mbtiles, -e directory, or -E archive\n", argv[0]);
 		usage(argv);
 		exit(EXIT_FAILURE);
 	}
@@ -1344,15 +3038,6 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (!(include_count || include_density)) {
-		include_density = true;
-	}
-
-	if (force) {
-		unlink(outfile);
-	}
-	sqlite3 *outdb = mbtiles_open(outfile, argv, false);
-
 	double minlat = 90, minlon = 180, maxlat = -90, maxlon = -180, midlat = 0, midlon = 0;
 	std::vector<long long> zoom_max;
 	size_t zooms = 0;
@@ -1387,6 +3072,41 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (zooms != 0 && (tile_region.rects.size() > 0 || incremental)) {
+		fprintf(stderr, "%s: --bbox, --tiles, --delta, and --previous only apply to tiling a .count file\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (incremental && tile_region.rects.size() > 0) {
+		fprintf(stderr, "%s: --delta and --previous can't be combined with --bbox or --tiles\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	tile_output out;
+	output_open(out, outkind, outfile, argv, force, deduplicate, bitmap, tile_region.rects.size() > 0 || incremental);
+
+	if (incremental && !out.update) {
+		fprintf(stderr, "%s: --delta and --previous update an existing mbtiles, and %s is not one\n", argv[0], outfile);
+		exit(EXIT_FAILURE);
+	}
+
+	// Replacing part of an existing tileset: its normalization is kept,
+	// and its tiles in the region are removed in case some are now empty
+	if (out.update) {
+		zoom_max = read_max_density(out.db, outfile);
+
+		if (maxzoom < 0 && bin < 0) {
+			maxzoom = zoom_max.size() - 1;
+		} else if ((maxzoom >= 0 ? maxzoom : bin - (int) detail) + 1 != (int) zoom_max.size()) {
+			fprintf(stderr, "%s: %s has maxzoom %zu, not %d\n", argv[0], outfile, zoom_max.size() - 1, maxzoom >= 0 ? maxzoom : bin - (int) detail);
+			exit(EXIT_FAILURE);
+		}
+
+		clear_region(out.db, tile_region, minzoom, zoom_max.size() - 1);
+	}
+
+	tile_writer writer(&out, 64 * cpus);
+	start_writer(&writer);
+
 	if (zooms == 0) {
 		if (maxzoom < 0 && bin < 0) {
 			fprintf(stderr, "%s: Must specify either maxzoom (-z) or bin size (-s)\n", argv[0]);
@@ -1419,6 +3139,20 @@ int main(int argc, char **argv) {
 			exit(EXIT_FAILURE);
 		}
 
+		// Each scanning thread has a grid for every zoom level, and may set
+		// aside a partial grid for each of them at either end of its shard.
+		// Each encoding thread has a grid, and the queue between them holds
+		// two for each thread. With a memory budget, fewer threads are used
+		// if that many grids for all of them would not fit.
+		size_t grid_bytes = sizeof(long long) << (2 * detail);
+		size_t thread_bytes = grid_bytes * (3 * zooms + 3);
+		if (memory_budget > 0 && memory_budget < thread_bytes) {
+			fprintf(stderr, "%s: Warning: tiling with detail %zu and %zu zoom levels takes about %zu MB, more than the memory budget\n", argv[0], detail, zooms, thread_bytes / 1024 / 1024);
+		} else if (budget_count(thread_bytes, cpus) < cpus && !quiet) {
+			fprintf(stderr, "Using %zu threads to stay within the memory budget\n", budget_count(thread_bytes, cpus));
+		}
+		cpus = budget_count(thread_bytes, cpus);
+
 		struct stat st;
 		if (stat(argv[optind], &st) != 0) {
 			perror(optind[argv]);
@@ -1449,11 +3183,56 @@ int main(int argc, char **argv) {
 			exit(EXIT_FAILURE);
 		}
 
-		for (size_t pass = 0; pass < 2; pass++) {
+		// Only the records for tiles in the --bbox or --tiles region are read
+		size_t records = (st.st_size - HEADER_LEN) / RECORD_BYTES;
+		record_spans spans = find_key_spans(fps[0], records, region_key_ranges(tile_region, minzoom));
+
+		// An incremental update still has to scan everything once to see
+		// whether the normalization has changed, but then only reads
+		// the records for the tiles that changed.
+		std::vector<long long> previous_max;
+		if (incremental) {
+			previous_max = zoom_max;
+			zoom_max.clear();
+
+			if (delta != NULL) {
+				changed_tiles = find_changed_tiles(delta, NULL, zooms - 1);
+			} else {
+				changed_tiles = find_changed_tiles(argv[optind], previous, zooms - 1);
+			}
+		}
+
+		for (size_t pass = (out.update && !incremental) ? 1 : 0; pass < 2; pass++) {
 			std::atomic<int> progress[cpus];
 			std::vector<tiler> tilers;
 			tilers.resize(cpus);
 
+			// On the second pass, completed tiles go through the encoders
+			// while the scanners continue with the following records.
+
+			bounded_queue<tile> grids(2 * cpus);
+			std::vector<density_table> densities = make_density_tables(zoom_max);
+			recycler<std::vector<long long>> spares;
+			std::vector<encoder> encoders;
+			encoders.resize(cpus);
+
+			if (pass == 1) {
+				for (size_t j = 0; j < cpus; j++) {
+					encoders[j].grids = &grids;
+					encoders[j].spares = &spares;
+					encoders[j].writer = &writer;
+					encoders[j].densities = &densities;
+					encoders[j].detail = detail;
+					encoders[j].layername = layername;
+					encoders[j].layermap = &layermaps[j];
+
+					if (pthread_create(&encoders[j].thread, NULL, run_encoder, &encoders[j]) != 0) {
+						perror("pthread_create");
+						exit(EXIT_FAILURE);
+					}
+				}
+			}
+
 			for (size_t j = 0; j < cpus; j++) {
 				for (size_t z = 0; z < zooms; z++) {
 					tilers[j].tiles.push_back(tile(detail, z));
@@ -1465,27 +3244,20 @@ int main(int argc, char **argv) {
 				tilers[j].zooms = zooms;
 				tilers[j].minzoom = minzoom;
 				tilers[j].detail = detail;
-				tilers[j].outdb = outdb;
+				tilers[j].grids = &grids;
+				tilers[j].spares = &spares;
 				tilers[j].progress = progress;
 				tilers[j].progress[j] = 0;
 				tilers[j].cpus = cpus;
 				tilers[j].shard = j;
 				tilers[j].maxzoom = zooms - 1;
 				tilers[j].pass = pass;
-				tilers[j].zoom_max = zoom_max;
-				tilers[j].layername = layername;
-				tilers[j].layermap = &layermaps[j];
 			}
 
-			size_t records = (st.st_size - HEADER_LEN) / RECORD_BYTES;
 			for (size_t j = 0; j < cpus; j++) {
 				tilers[j].fp = fps[j];
-				tilers[j].start = j * records / cpus;
-				if (j > 0) {
-					tilers[j - 1].end = tilers[j].start;
-				}
 			}
-			tilers[cpus - 1].end = records;
+			size_t shard_zoom = choose_shard_zoom(tilers, fps[0], records, spans, minzoom, zooms - 1);
 
 			pthread_t pthreads[cpus];
 			for (size_t j = 0; j < cpus; j++) {
@@ -1504,33 +3276,49 @@ int main(int argc, char **argv) {
 				}
 			}
 
-			// Collect and consolidate partially counted tiles
+			// Collect and consolidate partially counted tiles,
+			// each zoom level on its own thread
 
-			std::map<std::vector<unsigned>, tile> partials;
+			std::vector<partial_merger> partials;
+			partials.resize(zooms);
+			size_t npartial = 0;
 			for (size_t j = 0; j < cpus; j++) {
+				npartial += tilers[j].partial_tiles.size();
 				for (size_t k = 0; k < tilers[j].partial_tiles.size(); k++) {
-					std::vector<unsigned> key;
-					key.push_back(tilers[j].partial_tiles[k].z);
-					key.push_back(tilers[j].partial_tiles[k].x);
-					key.push_back(tilers[j].partial_tiles[k].y);
+					partials[tilers[j].partial_tiles[k].z].tiles.push_back(std::move(tilers[j].partial_tiles[k]));
+				}
+				tilers[j].partial_tiles.clear();
+			}
 
-					auto a = partials.find(key);
+			partial_mergers pm;
+			pm.zooms = &partials;
+			pm.pass = pass;
+			pm.detail = detail;
+			pm.grids = &grids;
 
-					if (a == partials.end()) {
-						partials.insert(std::pair<std::vector<unsigned>, tile>(key, tilers[j].partial_tiles[k]));
-					} else {
-						for (size_t x = 0; x < (1U << detail) * (1U << detail); x++) {
-							a->second.count[x] += tilers[j].partial_tiles[k].count[x];
-						}
-					}
+			run_tasks(cpus, zooms, run_partials, &pm);
+
+			for (size_t z = 0; z < zooms; z++) {
+				if (partials[z].max > tilers[0].max[z]) {
+					tilers[0].max[z] = partials[z].max;
 				}
 			}
 
-			for (auto a = partials.begin(); a != partials.end(); a++) {
-				if (pass == 0) {
-					gather_quantile(a->second, detail, tilers[0].max[a->second.z]);
-				} else {
-					make_tile(outdb, a->second, a->second.z, detail, zoom_max[a->second.z], layername, &layermaps[0]);
+			if (pass == 1) {
+				grids.close();
+
+				for (size_t j = 0; j < cpus; j++) {
+					void *retval;
+
+					if (pthread_join(encoders[j].thread, &retval) != 0) {
+						perror("pthread_join");
+						exit(EXIT_FAILURE);
+					}
+				}
+
+				if (report_timing) {
+					report_scan(tilers, grids, encoders);
+					fprintf(stderr, "shards: aligned to zoom %zu, %zu partial tiles merged\n", shard_zoom, npartial);
 				}
 			}
 
@@ -1548,7 +3336,35 @@ int main(int argc, char **argv) {
 				}
 
 				regress(zoom_max, minzoom);
-			} else {
+
+				if (incremental) {
+					size_t whole = 0;
+					whole_zoom.resize(zooms);
+
+					for (size_t z = 0; z < zooms; z++) {
+						if ((int) z >= minzoom && fabs(zoom_max[z] - previous_max[z]) > max_density_tolerance * previous_max[z]) {
+							whole_zoom[z] = true;
+							whole++;
+						} else {
+							zoom_max[z] = previous_max[z];
+						}
+					}
+
+					if (whole == 0) {
+						spans = find_key_spans(fps[0], records, changed_key_ranges(minzoom));
+					}
+
+					clear_changed(out.db, minzoom, zooms - 1);
+
+					if (!quiet) {
+						fprintf(stderr, "%zu changed tiles at zoom %zu, %zu zoom levels to make again in full\n", changed_tiles.size(), zooms - 1, whole);
+					}
+				}
+			}
+
+			// The extent comes from whichever pass reads all the counts,
+			// since an incremental second pass only reads the changed ones
+			if (pass == (incremental ? 0 : 1)) {
 				long long file_bbox[4] = {UINT_MAX, UINT_MAX, 0, 0};
 				for (size_t j = 0; j < cpus; j++) {
 					if (tilers[j].bbox[0] < file_bbox[0]) {
@@ -1579,14 +3395,35 @@ int main(int argc, char **argv) {
 		}
 	} else {
 		fprintf(stderr, "going to merge %zu zoom levels\n", zooms);
-		merge_tiles(argv + optind, argc - optind, cpus, outdb, zooms, zoom_max, midlat, midlon, minlat, minlon, maxlat, maxlon, layername, layermaps);
+		merge_tiles(argv + optind, argc - optind, cpus, detail, &writer, zooms, zoom_max, midlat, midlon, minlat, minlon, maxlat, maxlon, layername, layermaps);
+	}
+
+	finish_writer(&writer);
+	if (report_timing) {
+		report_writer(writer);
+	}
+
+	// An updated tileset keeps the metadata it already had,
+	// except for any zoom levels that had to be renormalized
+	// and the extent and layers of the counts that changed
+	if (incremental) {
+		update_max_density(zoom_max, out.db);
+		update_extent(out.db, minlat, minlon, maxlat, maxlon, midlat, midlon, zooms - 1);
+		if (!bitmap) {
+			update_layers(out.db, layername);
+		}
 	}
+	if (!out.update) {
+		std::map<std::string, layermap_entry> lm = merge_layermaps(layermaps);
 
-	std::map<std::string, layermap_entry> lm = merge_layermaps(layermaps);
+		mbtiles_write_metadata(out.db, NULL, outfile, 0, zooms - 1, minlat, minlon, maxlat, maxlon, midlat, midlon, false, "", lm, !bitmap, outfile, true);
 
-	mbtiles_write_metadata(outdb, NULL, outfile, 0, zooms - 1, minlat, minlon, maxlat, maxlon, midlat, midlon, false, "", lm, !bitmap, outfile, true);
+		write_meta(zoom_max, out.db);
+	}
 
-	write_meta(zoom_max, outdb);
+	output_close(out, argv[0]);
 
-	mbtiles_close(outdb, argv[0]);
+	if (report_timing || memory_budget > 0) {
+		report_memory(argv[0]);
+	}
 }
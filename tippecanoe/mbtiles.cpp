@@ -16,7 +16,7 @@
 #include "text.hpp"
 #include "milo/dtoa_milo.h"
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool deduplicate) {
 	sqlite3 *outdb;
 
 	if (sqlite3_open(dbname, &outdb) != SQLITE_OK) {
@@ -43,28 +43,182 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
-		}
-	}
 	if (sqlite3_exec(outdb, "create unique index name on metadata (name);", NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "%s: index metadata: %s\n", argv[0], err);
 		if (!forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+
+	if (deduplicate) {
+		// Identical tiles share one row in images, found through its hash in map
+		if (sqlite3_exec(outdb, "CREATE TABLE map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create map table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE TABLE images (tile_data blob, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create images table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "create unique index map_index on map (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index map: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "create unique index images_id on images (tile_id);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index images: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles view: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
+		if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	return outdb;
+}
+
+// Opens an existing tileset so that tiles in it can be replaced
+sqlite3 *mbtiles_reopen(char *dbname, char **argv) {
+	sqlite3 *outdb;
+
+	if (sqlite3_open_v2(dbname, &outdb, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], dbname, sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+
+	char *err = NULL;
+	if (sqlite3_exec(outdb, "PRAGMA synchronous=0", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: async: %s\n", argv[0], err);
+		exit(EXIT_FAILURE);
+	}
+	if (sqlite3_exec(outdb, "PRAGMA locking_mode=EXCLUSIVE", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: async: %s\n", argv[0], err);
+		exit(EXIT_FAILURE);
+	}
+	if (sqlite3_exec(outdb, "SELECT zoom_level FROM tiles LIMIT 1;", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s: not a tileset: %s\n", argv[0], dbname, err);
+		exit(EXIT_FAILURE);
 	}
 
 	return outdb;
 }
 
+// Whether the tileset uses the deduplicated map/images schema
+// instead of a flat tiles table
+bool mbtiles_has_map(sqlite3 *db) {
+	bool found = false;
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, "SELECT name from sqlite_master where type = 'table' and name = 'map';", -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			found = true;
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	return found;
+}
+
+// MurmurHash3_x64_128, by Austin Appleby, who placed it in the public domain
+static inline unsigned long long rotl64(unsigned long long x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long fmix64(unsigned long long k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static void murmur3_128(const unsigned char *data, size_t len, unsigned long long &h1, unsigned long long &h2) {
+	const unsigned long long c1 = 0x87c37b91114253d5ULL;
+	const unsigned long long c2 = 0x4cf5ad432745937fULL;
+	size_t nblocks = len / 16;
+
+	h1 = h2 = 0;
+
+	for (size_t i = 0; i < nblocks; i++) {
+		unsigned long long k1 = 0, k2 = 0;
+		for (int b = 7; b >= 0; b--) {
+			k1 = (k1 << 8) | data[i * 16 + b];
+			k2 = (k2 << 8) | data[i * 16 + 8 + b];
+		}
+
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = rotl64(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = rotl64(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	const unsigned char *tail = data + nblocks * 16;
+	unsigned long long k1 = 0, k2 = 0;
+	for (int b = (len & 15) - 1; b >= 0; b--) {
+		if (b >= 8) {
+			k2 = (k2 << 8) | tail[b];
+		} else {
+			k1 = (k1 << 8) | tail[b];
+		}
+	}
+	if ((len & 15) > 8) {
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+	}
+	if ((len & 15) > 0) {
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+}
+
 void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size) {
 	sqlite3_stmt *stmt;
 	const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
@@ -86,6 +240,112 @@ void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data,
 	}
 }
 
+void mbtiles_writer_open(mbtiles_writer &w, sqlite3 *outdb, size_t batch) {
+	w.outdb = outdb;
+	w.batch = batch;
+	w.pending = 0;
+	w.deduplicate = mbtiles_has_map(outdb);
+
+	const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
+	if (w.replace) {
+		query = "insert or replace into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
+	}
+	if (w.deduplicate) {
+		query = "insert into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)";
+		if (w.replace) {
+			query = "insert or replace into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)";
+		}
+
+		const char *image_query = "insert or ignore into images (tile_data, tile_id) values (?, ?)";
+		if (sqlite3_prepare_v2(outdb, image_query, -1, &w.image_stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 image insert prep failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (sqlite3_prepare_v2(outdb, query, -1, &w.stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 insert prep failed: %s\n", sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void mbtiles_writer_exec(mbtiles_writer &w, const char *sql) {
+	char *err = NULL;
+	if (sqlite3_exec(w.outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 %s failed: %s\n", sql, err);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void mbtiles_writer_tile(mbtiles_writer &w, int z, int tx, int ty, const char *data, int size) {
+	if (w.pending == 0) {
+		mbtiles_writer_exec(w, "BEGIN");
+	}
+
+	char id[33];
+	if (w.deduplicate) {
+		unsigned long long h1, h2;
+		murmur3_128((const unsigned char *) data, size, h1, h2);
+		snprintf(id, sizeof(id), "%016llx%016llx", h1, h2);
+
+		sqlite3_bind_blob(w.image_stmt, 1, data, size, SQLITE_STATIC);
+		sqlite3_bind_text(w.image_stmt, 2, id, -1, SQLITE_STATIC);
+
+		if (sqlite3_step(w.image_stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 image insert failed: %s\n", sqlite3_errmsg(w.outdb));
+		}
+		if (sqlite3_changes(w.outdb) == 0) {
+			w.duplicates++;
+		}
+		if (sqlite3_reset(w.image_stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(w.outdb));
+		}
+		sqlite3_clear_bindings(w.image_stmt);
+	}
+
+	sqlite3_bind_int(w.stmt, 1, z);
+	sqlite3_bind_int(w.stmt, 2, tx);
+	sqlite3_bind_int(w.stmt, 3, (1 << z) - 1 - ty);
+	if (w.deduplicate) {
+		sqlite3_bind_text(w.stmt, 4, id, -1, SQLITE_STATIC);
+	} else {
+		sqlite3_bind_blob(w.stmt, 4, data, size, SQLITE_STATIC);
+	}
+
+	if (sqlite3_step(w.stmt) != SQLITE_DONE) {
+		fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(w.outdb));
+	}
+	if (sqlite3_reset(w.stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(w.outdb));
+	}
+	sqlite3_clear_bindings(w.stmt);
+
+	w.pending++;
+	if (w.pending >= w.batch) {
+		mbtiles_writer_exec(w, "COMMIT");
+		w.pending = 0;
+	}
+}
+
+void mbtiles_writer_close(mbtiles_writer &w) {
+	if (w.pending > 0) {
+		mbtiles_writer_exec(w, "COMMIT");
+		w.pending = 0;
+	}
+
+	if (sqlite3_finalize(w.stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(w.outdb));
+	}
+	w.stmt = NULL;
+
+	if (w.image_stmt != NULL) {
+		if (sqlite3_finalize(w.image_stmt) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(w.outdb));
+		}
+		w.image_stmt = NULL;
+	}
+}
+
 static void quote(std::string &buf, std::string const &s) {
 	for (size_t i = 0; i < s.size(); i++) {
 		unsigned char ch = s[i];
@@ -306,6 +566,68 @@ std::string tilestats(std::map<std::string, layermap_entry> const &layermap1, si
 	return out2;
 }
 
+// The vector_layers and tilestats of the layers, as the JSON metadata
+std::string mbtiles_layer_json(std::map<std::string, layermap_entry> const &layermap, bool do_tilestats) {
+	size_t elements = 100;
+	std::string buf = "{";
+	aprintf(&buf, "\"vector_layers\": [ ");
+
+	std::vector<std::string> lnames;
+	for (auto ai = layermap.begin(); ai != layermap.end(); ++ai) {
+		lnames.push_back(ai->first);
+	}
+
+	for (size_t i = 0; i < lnames.size(); i++) {
+		if (i != 0) {
+			aprintf(&buf, ", ");
+		}
+
+		auto fk = layermap.find(lnames[i]);
+		aprintf(&buf, "{ \"id\": \"");
+		quote(buf, lnames[i]);
+		aprintf(&buf, "\", \"description\": \"\", \"minzoom\": %d, \"maxzoom\": %d, \"fields\": {", fk->second.minzoom, fk->second.maxzoom);
+
+		bool first = true;
+		for (auto j = fk->second.file_keys.begin(); j != fk->second.file_keys.end(); ++j) {
+			if (first) {
+				first = false;
+			} else {
+				aprintf(&buf, ", ");
+			}
+
+			aprintf(&buf, "\"");
+			quote(buf, j->first.c_str());
+
+			int type = 0;
+			for (auto s : j->second.sample_values) {
+				type |= (1 << s.type);
+			}
+
+			if (type == (1 << mvt_double)) {
+				aprintf(&buf, "\": \"Number\"");
+			} else if (type == (1 << mvt_bool)) {
+				aprintf(&buf, "\": \"Boolean\"");
+			} else if (type == (1 << mvt_string)) {
+				aprintf(&buf, "\": \"String\"");
+			} else {
+				aprintf(&buf, "\": \"Mixed\"");
+			}
+		}
+
+		aprintf(&buf, "} }");
+	}
+
+	aprintf(&buf, " ]");
+
+	if (do_tilestats && elements > 0) {
+		aprintf(&buf, ",\"tilestats\": %s", tilestats(layermap, elements).c_str());
+	}
+
+	aprintf(&buf, "}");
+
+	return buf;
+}
+
 void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats) {
 	char *sql, *err;
 
@@ -414,66 +736,7 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 	sqlite3_free(sql);
 
 	if (vector) {
-		size_t elements = 100;
-		std::string buf;
-
-		{
-			buf = "{";
-			aprintf(&buf, "\"vector_layers\": [ ");
-
-			std::vector<std::string> lnames;
-			for (auto ai = layermap.begin(); ai != layermap.end(); ++ai) {
-				lnames.push_back(ai->first);
-			}
-
-			for (size_t i = 0; i < lnames.size(); i++) {
-				if (i != 0) {
-					aprintf(&buf, ", ");
-				}
-
-				auto fk = layermap.find(lnames[i]);
-				aprintf(&buf, "{ \"id\": \"");
-				quote(buf, lnames[i]);
-				aprintf(&buf, "\", \"description\": \"\", \"minzoom\": %d, \"maxzoom\": %d, \"fields\": {", fk->second.minzoom, fk->second.maxzoom);
-
-				bool first = true;
-				for (auto j = fk->second.file_keys.begin(); j != fk->second.file_keys.end(); ++j) {
-					if (first) {
-						first = false;
-					} else {
-						aprintf(&buf, ", ");
-					}
-
-					aprintf(&buf, "\"");
-					quote(buf, j->first.c_str());
-
-					int type = 0;
-					for (auto s : j->second.sample_values) {
-						type |= (1 << s.type);
-					}
-
-					if (type == (1 << mvt_double)) {
-						aprintf(&buf, "\": \"Number\"");
-					} else if (type == (1 << mvt_bool)) {
-						aprintf(&buf, "\": \"Boolean\"");
-					} else if (type == (1 << mvt_string)) {
-						aprintf(&buf, "\": \"String\"");
-					} else {
-						aprintf(&buf, "\": \"Mixed\"");
-					}
-				}
-
-				aprintf(&buf, "} }");
-			}
-
-			aprintf(&buf, " ]");
-
-			if (do_tilestats && elements > 0) {
-				aprintf(&buf, ",\"tilestats\": %s", tilestats(layermap, elements).c_str());
-			}
-
-			aprintf(&buf, "}");
-		}
+		std::string buf = mbtiles_layer_json(layermap, do_tilestats);
 
 		sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('json', %Q);", buf.c_str());
 		if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
@@ -493,27 +756,8 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 			exit(EXIT_FAILURE);
 		}
 
-		fprintf(fp, "{\n");
-
-		sqlite3_stmt *stmt;
-		bool first = true;
-		if (sqlite3_prepare_v2(db, "SELECT name, value from metadata;", -1, &stmt, NULL) == SQLITE_OK) {
-			while (sqlite3_step(stmt) == SQLITE_ROW) {
-				std::string key, value;
-
-				quote(key, (const char *) sqlite3_column_text(stmt, 0));
-				quote(value, (const char *) sqlite3_column_text(stmt, 1));
-
-				if (!first) {
-					fprintf(fp, ",\n");
-				}
-				fprintf(fp, "    \"%s\": \"%s\"", key.c_str(), value.c_str());
-				first = false;
-			}
-			sqlite3_finalize(stmt);
-		}
-
-		fprintf(fp, "\n}\n");
+		std::string json = mbtiles_metadata_json(db);
+		fwrite(json.c_str(), sizeof(char), json.size(), fp);
 		fclose(fp);
 	}
 
@@ -525,6 +769,32 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 	}
 }
 
+// The metadata table as a JSON object, with every value as a string
+std::string mbtiles_metadata_json(sqlite3 *db) {
+	std::string out = "{\n";
+
+	sqlite3_stmt *stmt;
+	bool first = true;
+	if (sqlite3_prepare_v2(db, "SELECT name, value from metadata;", -1, &stmt, NULL) == SQLITE_OK) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			std::string key, value;
+
+			quote(key, (const char *) sqlite3_column_text(stmt, 0));
+			quote(value, (const char *) sqlite3_column_text(stmt, 1));
+
+			if (!first) {
+				out.append(",\n");
+			}
+			aprintf(&out, "    \"%s\": \"%s\"", key.c_str(), value.c_str());
+			first = false;
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	out.append("\n}\n");
+	return out;
+}
+
 void mbtiles_close(sqlite3 *outdb, const char *pgm) {
 	char *err;
 
@@ -35,12 +35,37 @@ struct layermap_entry {
 	}
 };
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable);
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool deduplicate);
+sqlite3 *mbtiles_reopen(char *dbname, char **argv);
+bool mbtiles_has_map(sqlite3 *db);
 
 void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
 
+// For writing many tiles from one thread: reuses a single prepared
+// insert statement and commits a transaction every `batch` tiles.
+// If the tileset has the map/images schema, each tile is stored
+// under the hash of its contents so that duplicates are kept once.
+// With `replace`, tiles that are already in the tileset are overwritten.
+struct mbtiles_writer {
+	sqlite3 *outdb = NULL;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *image_stmt = NULL;
+	bool deduplicate = false;
+	bool replace = false;
+	size_t batch = 0;
+	size_t pending = 0;
+	size_t duplicates = 0;
+};
+
+void mbtiles_writer_open(mbtiles_writer &w, sqlite3 *outdb, size_t batch);
+void mbtiles_writer_tile(mbtiles_writer &w, int z, int tx, int ty, const char *data, int size);
+void mbtiles_writer_close(mbtiles_writer &w);
+
 void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats);
 
+std::string mbtiles_layer_json(std::map<std::string, layermap_entry> const &layermap, bool do_tilestats);
+std::string mbtiles_metadata_json(sqlite3 *db);
+
 void mbtiles_close(sqlite3 *outdb, const char *pgm);
 
 void aprintf(std::string *buf, const char *format, ...);
@@ -23,65 +23,122 @@ bool is_compressed(std::string const &data) {
 	return data.size() > 2 && (((uint8_t) data[0] == 0x78 && (uint8_t) data[1] == 0x9C) || ((uint8_t) data[0] == 0x1F && (uint8_t) data[1] == 0x8B));
 }
 
+mvt_zlib::mvt_zlib(int nlevel) {
+	level = nlevel;
+	deflating = false;
+	inflating = false;
+}
+
+mvt_zlib::~mvt_zlib() {
+	if (deflating) {
+		deflateEnd(&deflate_s);
+	}
+	if (inflating) {
+		inflateEnd(&inflate_s);
+	}
+}
+
 // https://github.com/mapbox/mapnik-vector-tile/blob/master/src/vector_tile_compression.hpp
-int decompress(std::string const &input, std::string &output) {
-	z_stream inflate_s;
-	inflate_s.zalloc = Z_NULL;
-	inflate_s.zfree = Z_NULL;
-	inflate_s.opaque = Z_NULL;
-	inflate_s.avail_in = 0;
-	inflate_s.next_in = Z_NULL;
-	if (inflateInit2(&inflate_s, 32 + 15) != Z_OK) {
-		fprintf(stderr, "error: %s\n", inflate_s.msg);
+int mvt_zlib::decompress(std::string const &input, std::string &output) {
+	if (inflating) {
+		inflateReset(&inflate_s);
+	} else {
+		inflate_s.zalloc = Z_NULL;
+		inflate_s.zfree = Z_NULL;
+		inflate_s.opaque = Z_NULL;
+		inflate_s.avail_in = 0;
+		inflate_s.next_in = Z_NULL;
+		if (inflateInit2(&inflate_s, 32 + 15) != Z_OK) {
+			fprintf(stderr, "error: %s\n", inflate_s.msg);
+			return 0;
+		}
+		inflating = true;
 	}
+
 	inflate_s.next_in = (Bytef *) input.data();
 	inflate_s.avail_in = input.size();
+
+	// The output string keeps its capacity from one tile to the next,
+	// so it only has to grow for a tile bigger than any before it.
 	size_t length = 0;
-	do {
-		output.resize(length + 2 * input.size());
-		inflate_s.avail_out = 2 * input.size();
-		inflate_s.next_out = (Bytef *) (output.data() + length);
+	while (true) {
+		if (output.size() < length + 2 * input.size()) {
+			output.resize(length + 2 * input.size());
+		}
+		inflate_s.next_out = (Bytef *) (&output[0] + length);
+		inflate_s.avail_out = output.size() - length;
+
 		int ret = inflate(&inflate_s, Z_FINISH);
 		if (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR) {
 			fprintf(stderr, "error: %s\n", inflate_s.msg);
 			return 0;
 		}
 
-		length += (2 * input.size() - inflate_s.avail_out);
-	} while (inflate_s.avail_out == 0);
-	inflateEnd(&inflate_s);
+		length = inflate_s.total_out;
+		if (ret == Z_STREAM_END || inflate_s.avail_out != 0) {
+			break;
+		}
+	}
+
 	output.resize(length);
 	return 1;
 }
 
-// https://github.com/mapbox/mapnik-vector-tile/blob/master/src/vector_tile_compression.hpp
-int compress(std::string const &input, std::string &output) {
-	z_stream deflate_s;
-	deflate_s.zalloc = Z_NULL;
-	deflate_s.zfree = Z_NULL;
-	deflate_s.opaque = Z_NULL;
-	deflate_s.avail_in = 0;
-	deflate_s.next_in = Z_NULL;
-	deflateInit2(&deflate_s, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+// Compress with a single call to deflate(), into a buffer that
+// deflateBound() says is big enough to hold the whole result.
+int mvt_zlib::compress(std::string const &input, std::string &output) {
+	if (deflating) {
+		deflateReset(&deflate_s);
+	} else {
+		deflate_s.zalloc = Z_NULL;
+		deflate_s.zfree = Z_NULL;
+		deflate_s.opaque = Z_NULL;
+		deflate_s.avail_in = 0;
+		deflate_s.next_in = Z_NULL;
+		if (deflateInit2(&deflate_s, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return -1;
+		}
+		deflating = true;
+	}
+
 	deflate_s.next_in = (Bytef *) input.data();
 	deflate_s.avail_in = input.size();
+
 	size_t length = 0;
-	do {
-		size_t increase = input.size() / 2 + 1024;
-		output.resize(length + increase);
-		deflate_s.avail_out = increase;
-		deflate_s.next_out = (Bytef *) (output.data() + length);
+	size_t bound = deflateBound(&deflate_s, input.size());
+	while (true) {
+		if (buffer.size() < length + bound) {
+			buffer.resize(length + bound);
+		}
+		deflate_s.next_out = (Bytef *) (&buffer[0] + length);
+		deflate_s.avail_out = buffer.size() - length;
+
 		int ret = deflate(&deflate_s, Z_FINISH);
 		if (ret != Z_STREAM_END && ret != Z_OK && ret != Z_BUF_ERROR) {
 			return -1;
 		}
-		length += (increase - deflate_s.avail_out);
-	} while (deflate_s.avail_out == 0);
-	deflateEnd(&deflate_s);
-	output.resize(length);
+
+		length = deflate_s.total_out;
+		if (ret == Z_STREAM_END) {
+			break;
+		}
+		bound = input.size() / 2 + 1024;
+	}
+
+	output.assign(buffer, 0, length);
 	return 0;
 }
 
+int decompress(std::string const &input, std::string &output) {
+	mvt_zlib z;
+	return z.decompress(input, output);
+}
+
+int compress(std::string const &input, std::string &output) {
+	mvt_zlib z;
+	return z.compress(input, output);
+}
+
 bool mvt_tile::decode(std::string &message, bool &was_compressed) {
 	layers.clear();
 	std::string src;
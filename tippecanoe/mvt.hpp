@@ -2,6 +2,7 @@
 #define MVT_HPP
 
 #include <sqlite3.h>
+#include <zlib.h>
 #include <string>
 #include <map>
 #include <set>
@@ -105,6 +106,26 @@ struct mvt_tile {
 	bool decode(std::string &message, bool &was_compressed);
 };
 
+// Deflate and inflate streams that are reset and reused from one tile
+// to the next instead of being set up again for each. Each thread that
+// compresses or decompresses tiles needs its own.
+struct mvt_zlib {
+	int level;
+	z_stream deflate_s;
+	z_stream inflate_s;
+	bool deflating;
+	bool inflating;
+	std::string buffer;
+
+	mvt_zlib(int nlevel = Z_BEST_COMPRESSION);
+	~mvt_zlib();
+	mvt_zlib(mvt_zlib const &) = delete;
+	mvt_zlib &operator=(mvt_zlib const &) = delete;
+
+	int compress(std::string const &input, std::string &output);
+	int decompress(std::string const &input, std::string &output);
+};
+
 bool is_compressed(std::string const &data);
 int decompress(std::string const &input, std::string &output);
 int compress(std::string const &input, std::string &output);
@@ -2,7 +2,6 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
-#include <atomic>
 #include "projection.hpp"
 
 struct projection projections[] = {
@@ -54,6 +53,118 @@ void lonlat2tile(double lon, double lat, int zoom, long long *x, long long *y) {
 	*y = lly;
 }
 
+// Sine of an angle from -pi/2 to pi/2, from its Taylor series,
+// which is within an ulp or two over that whole range
+static inline double sin_series(double a) {
+	double a2 = a * a;
+	double p = 1.9572941063391263e-20;
+	p = p * a2 - 8.22063524662433e-18;
+	p = p * a2 + 2.8114572543455206e-15;
+	p = p * a2 - 7.647163731819816e-13;
+	p = p * a2 + 1.6059043836821613e-10;
+	p = p * a2 - 2.505210838544172e-08;
+	p = p * a2 + 2.7557319223985893e-06;
+	p = p * a2 - 0.0001984126984126984;
+	p = p * a2 + 0.008333333333333333;
+	p = p * a2 - 0.16666666666666666;
+	return a + a * a2 * p;
+}
+
+// Natural log of a positive, finite number: the exponent times ln 2,
+// plus the log of the mantissa, scaled into sqrt(1/2) to sqrt(2),
+// from the series for 2 atanh((m - 1) / (m + 1))
+static inline double log_series(double v) {
+	unsigned long long bits;
+	memcpy(&bits, &v, sizeof(bits));
+
+	// A mantissa above about sqrt(2), judging from its top 20 bits, is
+	// halved by giving it the exponent of 1/2 instead of 1, all in 32-bit
+	// integers so that it can be vectorized
+	int high = (int) (bits >> 32);
+	int big = (high & 0xFFFFF) > 0x6A09E;
+	int exponent = ((high >> 20) & 0x7FF) - 1023 + big;
+	bits = (bits & 0x000FFFFFFFFFFFFFULL) | ((unsigned long long) (0x3FF - big) << 52);
+
+	double m;
+	memcpy(&m, &bits, sizeof(m));
+
+	double t = (m - 1) / (m + 1);
+	double t2 = t * t;
+	double p = 1.0 / 23;
+	p = p * t2 + 1.0 / 21;
+	p = p * t2 + 1.0 / 19;
+	p = p * t2 + 1.0 / 17;
+	p = p * t2 + 1.0 / 15;
+	p = p * t2 + 1.0 / 13;
+	p = p * t2 + 1.0 / 11;
+	p = p * t2 + 1.0 / 9;
+	p = p * t2 + 1.0 / 7;
+	p = p * t2 + 1.0 / 5;
+	p = p * t2 + 1.0 / 3;
+
+	return exponent * M_LN2 + 2 * (t + t * t2 * p);
+}
+
+// Within this fraction of a zoom 32 tile of an edge, the approximation
+// might come down on the other side of it from lonlat2tile(), so those
+// points are projected again the slow way. The approximation is within
+// about 2e-6 of a tile of the true value, and lonlat2tile() within about
+// 5e-5, which it loses to cancellation in the southern hemisphere.
+#define BATCH_EDGE_GUARD 1e-4
+
+// Points are projected this many at a time, first the arithmetic for
+// all of them, in a loop with no branches or calls that the compiler
+// can vectorize, and then the checks and conversions
+#define BATCH_CHUNK 256
+
+// A little beyond the edge of the Mercator plane, at 85.0511 degrees
+#define BATCH_MAX_LAT 85.06
+
+// The same as lonlat2tile() at zoom 32 for each of `n` points,
+// but without the calls into libm except for the rare points that
+// are too close to the edge of a tile to be sure which side they are on
+void lonlat2tile_batch(size_t n, const double *lon, const double *lat, long long *x, long long *y) {
+	const double world = 1ULL << 32;
+	double fx[BATCH_CHUNK], fy[BATCH_CHUNK];
+
+	for (size_t base = 0; base < n; base += BATCH_CHUNK) {
+		size_t len = n - base < BATCH_CHUNK ? n - base : BATCH_CHUNK;
+
+		for (size_t i = 0; i < len; i++) {
+			double lo = lon[base + i];
+			double la = lat[base + i];
+
+			// tan + sec = (1 + sin) / cos, with cos from the sine of the
+			// complementary angle so that it stays precise near the poles,
+			// and southern latitudes mirrored north so that 1 + sin does not
+			// cancel out to nothing
+			double lat_rad = fabs(la) * M_PI / 180;
+			double s = sin_series(lat_rad);
+			double c = sin_series(M_PI / 2 - lat_rad);
+			double merc = copysign(log_series((1 + s) / c), la);
+
+			fx[i] = world * ((lo + 180) / 360);
+			fy[i] = world * (1 - (merc / M_PI)) / 2;
+		}
+
+		// Points off the top or bottom of the plane, or not on it at all,
+		// are clamped and projected the slow way, since beyond the plane
+		// lonlat2tile() itself loses precision in ways not worth matching
+		for (size_t i = 0; i < len; i++) {
+			long long ty = fy[i];
+			double fraction = fy[i] - ty;
+
+			if (!(fabs(lat[base + i]) <= BATCH_MAX_LAT && fabs(lon[base + i]) <= 360) ||
+			    fraction < BATCH_EDGE_GUARD || fraction > 1 - BATCH_EDGE_GUARD) {
+				lonlat2tile(lon[base + i], lat[base + i], 32, &x[base + i], &y[base + i]);
+			} else {
+				x[base + i] = fx[i];
+				y[base + i] = ty;
+			}
+		}
+	}
+}
+
 // http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
 void tile2lonlat(long long x, long long y, int zoom, double *lon, double *lat) {
 	unsigned long long n = 1LL << zoom;
@@ -93,49 +204,14 @@ void tiletoepsg3857(long long ix, long long iy, int zoom, double *ox, double *oy
 	*oy = ((1LL << 32) - 1 - iy - (1LL << 31)) * M_PI * 6378137.0 / (1LL << 31);
 }
 
-unsigned long long encode(unsigned int wx, unsigned int wy) {
-	unsigned long long out = 0;
-
-	int i;
-	for (i = 0; i < 32; i++) {
-		unsigned long long v = ((wx >> (32 - (i + 1))) & 1) << 1;
-		v |= (wy >> (32 - (i + 1))) & 1;
-		v = v << (64 - 2 * (i + 1));
-
-		out |= v;
-	}
-
-	return out;
+#ifdef MORTON_BMI2
+static bool has_bmi2() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("bmi2");
 }
 
-static std::atomic<unsigned char> decodex[256];
-static std::atomic<unsigned char> decodey[256];
-
-void decode(unsigned long long index, unsigned *wx, unsigned *wy) {
-	static std::atomic<int> initialized(0);
-	if (!initialized) {
-		for (size_t ix = 0; ix < 256; ix++) {
-			size_t xx = 0, yy = 0;
-
-			for (size_t i = 0; i < 32; i++) {
-				xx |= ((ix >> (64 - 2 * (i + 1) + 1)) & 1) << (32 - (i + 1));
-				yy |= ((ix >> (64 - 2 * (i + 1) + 0)) & 1) << (32 - (i + 1));
-			}
-
-			decodex[ix] = xx;
-			decodey[ix] = yy;
-		}
-
-		initialized = 1;
-	}
-
-	*wx = *wy = 0;
-
-	for (size_t i = 0; i < 8; i++) {
-		*wx |= ((unsigned) decodex[(index >> (8 * i)) & 0xFF]) << (4 * i);
-		*wy |= ((unsigned) decodey[(index >> (8 * i)) & 0xFF]) << (4 * i);
-	}
-}
+const bool morton_bmi2 = has_bmi2();
+#endif
 
 void set_projection_or_exit(const char *optarg) {
 	struct projection *p;
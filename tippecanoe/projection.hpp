@@ -1,12 +1,79 @@
 #ifndef PROJECTION_HPP
 #define PROJECTION_HPP
 
+#include <stddef.h>
+
 void lonlat2tile(double lon, double lat, int zoom, long long *x, long long *y);
+void lonlat2tile_batch(size_t n, const double *lon, const double *lat, long long *x, long long *y);
 void epsg3857totile(double ix, double iy, int zoom, long long *x, long long *y);
 void tile2lonlat(long long x, long long y, int zoom, double *lon, double *lat);
 void tiletoepsg3857(long long x, long long y, int zoom, double *ox, double *oy);
-unsigned long long encode(unsigned int wx, unsigned int wy);
-void decode(unsigned long long index, unsigned *wx, unsigned *wy);
+
+// Quadkeys interleave the bits of the 32-bit world x and y,
+// with each bit of x just above the corresponding bit of y.
+//
+// The bits are spread apart or squeezed together with masks and shifts,
+// or on x86 processors that have them, with the BMI2 PDEP and PEXT
+// instructions, which do the whole thing in one step each.
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MORTON_BMI2
+#include <immintrin.h>
+
+extern const bool morton_bmi2;  // whether this processor has PDEP and PEXT
+
+__attribute__((target("bmi2"))) static inline unsigned long long morton_spread_bmi2(unsigned v) {
+	return _pdep_u64(v, 0x5555555555555555ULL);
+}
+
+__attribute__((target("bmi2"))) static inline unsigned morton_squeeze_bmi2(unsigned long long v) {
+	return _pext_u64(v, 0x5555555555555555ULL);
+}
+#endif
+
+// Moves bit i of v to bit 2i
+static inline unsigned long long morton_spread_masks(unsigned v) {
+	unsigned long long x = v;
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+	x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x << 2)) & 0x3333333333333333ULL;
+	x = (x | (x << 1)) & 0x5555555555555555ULL;
+	return x;
+}
+
+// Moves bit 2i of v to bit i, dropping the odd bits
+static inline unsigned morton_squeeze_masks(unsigned long long v) {
+	unsigned long long x = v & 0x5555555555555555ULL;
+	x = (x | (x >> 1)) & 0x3333333333333333ULL;
+	x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+	x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+	return x;
+}
+
+static inline unsigned long long encode(unsigned int wx, unsigned int wy) {
+#ifdef MORTON_BMI2
+	if (morton_bmi2) {
+		return (morton_spread_bmi2(wx) << 1) | morton_spread_bmi2(wy);
+	}
+#endif
+	return (morton_spread_masks(wx) << 1) | morton_spread_masks(wy);
+}
+
+static inline void decode(unsigned long long index, unsigned *wx, unsigned *wy) {
+#ifdef MORTON_BMI2
+	if (morton_bmi2) {
+		*wx = morton_squeeze_bmi2(index >> 1);
+		*wy = morton_squeeze_bmi2(index);
+		return;
+	}
+#endif
+	*wx = morton_squeeze_masks(index >> 1);
+	*wy = morton_squeeze_masks(index);
+}
+
 void set_projection_or_exit(const char *optarg);
 
 struct projection {